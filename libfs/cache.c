@@ -0,0 +1,540 @@
+#include "cache.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+
+/************************* BUFFER CACHE ********************************/
+
+/* instance used by threads that never picked another one */
+cache _default_cache;
+
+/* cache the calling thread works on, see cache_use() */
+__thread cache *_cache = &_default_cache;
+
+/************************* FUNCTION IMPLEMENTATION *******************/
+
+bool cache_init()
+{
+    const char *blk_cnt = getenv("LIBFS_CACHE_BLOCKS");
+
+    pthread_mutex_init(&_cache->_lock, NULL);
+    pthread_cond_init(&_cache->_io_done, NULL);
+    memset(&_cache->_stats, 0, sizeof(_cache->_stats));
+    _cache->_capacity = blk_cnt ? atoi(blk_cnt) : CACHE_DEFAULT_BLK_CNT;
+    _cache->_clock_hand = 0;
+
+    if (_cache->_capacity <= 0)
+    {
+        _cache->_capacity = 0; /* cache disabled, every access goes to the disk */
+        return true;
+    }
+
+    /* power of two buckets, consecutive blocks land in consecutive buckets */
+    _cache->_hash_bucket_cnt = 1;
+    while (_cache->_hash_bucket_cnt < _cache->_capacity)
+    {
+        _cache->_hash_bucket_cnt *= 2;
+    }
+
+    _cache->_slots = calloc(_cache->_capacity, sizeof(cacheslot));
+    _cache->_data = malloc((size_t)_cache->_capacity * 4096);
+    _cache->_hash_bucket = malloc(_cache->_hash_bucket_cnt * sizeof(int));
+
+    if (_cache->_slots == NULL || _cache->_data == NULL || _cache->_hash_bucket == NULL)
+    {
+        cache_destroy();
+        return false;
+    }
+
+    for (int i = 0; i < _cache->_hash_bucket_cnt; i++)
+    {
+        _cache->_hash_bucket[i] = -1;
+    }
+
+    _cache->_stats.capacity = _cache->_capacity;
+
+    return true;
+}
+
+void cache_destroy()
+{
+    pthread_mutex_lock(&_cache->_lock);
+
+    for (int i = 0; i < _cache->_capacity && _cache->_slots != NULL; i++)
+    {
+        while (_cache->_slots[i]._loading || _cache->_slots[i]._busy)
+        {
+            cache_wait_slot(i); /* the disk must be done with a buffer before it is freed */
+        }
+    }
+
+    pthread_mutex_unlock(&_cache->_lock);
+
+    free(_cache->_slots);
+    free(_cache->_data);
+    free(_cache->_hash_bucket);
+    _cache->_slots = NULL;
+    _cache->_data = NULL;
+    _cache->_hash_bucket = NULL;
+    _cache->_capacity = _cache->_hash_bucket_cnt = 0;
+    pthread_cond_destroy(&_cache->_io_done);
+    pthread_mutex_destroy(&_cache->_lock);
+}
+
+cache *cache_use(cache *c)
+{
+    cache *prev = _cache;
+
+    _cache = c != NULL ? c : &_default_cache;
+
+    return prev;
+}
+
+bool cache_enabled()
+{
+    return _cache->_capacity > 0;
+}
+
+int cache_find_slot(size_t blk_idx)
+{
+    int slot;
+
+    while ((slot = cache_hash_lookup(blk_idx)) != -1 && (_cache->_slots[slot]._loading || _cache->_slots[slot]._busy))
+    {
+        cache_wait_slot(slot); /* the lock was dropped, look the block up again */
+    }
+
+    return slot;
+}
+
+void cache_wait_slot(int slot)
+{
+    cacheslot *s = &_cache->_slots[slot];
+
+    if (!s->_loading)
+    {
+        while (s->_busy)
+        {
+            pthread_cond_wait(&_cache->_io_done, &_cache->_lock);
+        }
+
+        return;
+    }
+
+    /* the first thread to need the block finishes the read ahead, the slot cannot be evicted while busy */
+    s->_loading = false;
+    s->_busy = true;
+    pthread_mutex_unlock(&_cache->_lock);
+
+    int ret = block_aio_wait(&s->_aio);
+
+    pthread_mutex_lock(&_cache->_lock);
+    s->_busy = false;
+
+    if (ret != 0)
+    {
+        cache_hash_remove(slot); /* read ahead failed, the block is not cached after all */
+        s->_valid = false;
+    }
+
+    pthread_cond_broadcast(&_cache->_io_done);
+}
+
+int cache_hash_lookup(size_t blk_idx)
+{
+    if (!cache_enabled())
+    {
+        return -1;
+    }
+
+    for (int i = _cache->_hash_bucket[blk_idx & (_cache->_hash_bucket_cnt - 1)]; i != -1; i = _cache->_slots[i]._hash_next)
+    {
+        if (_cache->_slots[i]._blk_idx == blk_idx)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void cache_hash_insert(int slot)
+{
+    int bucket = _cache->_slots[slot]._blk_idx & (_cache->_hash_bucket_cnt - 1);
+
+    _cache->_slots[slot]._hash_next = _cache->_hash_bucket[bucket];
+    _cache->_hash_bucket[bucket] = slot;
+}
+
+void cache_hash_remove(int slot)
+{
+    int *link = &_cache->_hash_bucket[_cache->_slots[slot]._blk_idx & (_cache->_hash_bucket_cnt - 1)];
+
+    while (*link != slot)
+    {
+        link = &_cache->_slots[*link]._hash_next;
+    }
+
+    *link = _cache->_slots[slot]._hash_next;
+}
+
+/* pick a slot to reuse with CLOCK, writing its block back if dirty with the lock dropped, -1 if every slot is pinned */
+int cache_evict()
+{
+    /* two sweeps clear every reference bit, so an unpinned slot is always found by then */
+    for (int step = 0; step < 2 * _cache->_capacity; step++)
+    {
+        int slot = _cache->_clock_hand;
+        cacheslot *s = &_cache->_slots[slot];
+
+        _cache->_clock_hand = (_cache->_clock_hand + 1) % _cache->_capacity;
+
+        if (!s->_valid)
+        {
+            return slot;
+        }
+
+        if (s->_pincnt > 0 || s->_loading || s->_busy)
+        {
+            continue;
+        }
+
+        if (s->_referenced)
+        {
+            s->_referenced = false; /* second chance */
+            continue;
+        }
+
+        if (s->_dirty)
+        {
+            /* write back without the lock, busy keeps other threads off the slot meanwhile */
+            s->_busy = true;
+            pthread_mutex_unlock(&_cache->_lock);
+            assert(block_write(s->_blk_idx, _cache->_data + (size_t)slot * 4096) == 0);
+            pthread_mutex_lock(&_cache->_lock);
+            s->_busy = false;
+            pthread_cond_broadcast(&_cache->_io_done);
+            _cache->_stats.writebacks++;
+        }
+
+        cache_hash_remove(slot);
+        s->_valid = s->_dirty = false;
+        _cache->_stats.evictions++;
+
+        return slot;
+    }
+
+    return -1;
+}
+
+/* take a free or evicted slot for a block that is not cached yet */
+int cache_install(size_t blk_idx)
+{
+    int slot = cache_evict();
+
+    if (slot == -1 || cache_hash_lookup(blk_idx) != -1)
+    {
+        return -1; /* no slot, or the block was cached by another thread while a victim was written back */
+    }
+
+    cacheslot *s = &_cache->_slots[slot];
+
+    s->_blk_idx = blk_idx;
+    s->_valid = true;
+    s->_dirty = false;
+    s->_referenced = true;
+    s->_pincnt = 0;
+    s->_loading = false;
+    s->_busy = false;
+    cache_hash_insert(slot);
+
+    return slot;
+}
+
+bool cache_contains(size_t blk_idx)
+{
+    if (!cache_enabled())
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&_cache->_lock);
+    bool found = cache_find_slot(blk_idx) != -1;
+    pthread_mutex_unlock(&_cache->_lock);
+
+    return found;
+}
+
+uint8_t *cache_lookup(size_t blk_idx)
+{
+    pthread_mutex_lock(&_cache->_lock);
+    uint8_t *data = cache_pin(blk_idx);
+    pthread_mutex_unlock(&_cache->_lock);
+
+    return data;
+}
+
+uint8_t *cache_pin(size_t blk_idx)
+{
+    int slot = cache_find_slot(blk_idx);
+
+    if (slot == -1)
+    {
+        _cache->_stats.misses++;
+        return NULL;
+    }
+
+    _cache->_stats.hits++;
+    _cache->_slots[slot]._referenced = true;
+    _cache->_slots[slot]._pincnt++;
+
+    return _cache->_data + (size_t)slot * 4096;
+}
+
+uint8_t *cache_grab(size_t blk_idx, bool fill)
+{
+    if (!cache_enabled())
+    {
+        return cache_lookup(blk_idx); /* counts the miss */
+    }
+
+    pthread_mutex_lock(&_cache->_lock);
+
+    uint8_t *data = cache_pin(blk_idx);
+    int slot = -1;
+
+    while (data == NULL && (slot = cache_install(blk_idx)) == -1 && cache_hash_lookup(blk_idx) != -1)
+    {
+        data = cache_pin(blk_idx); /* cached by another thread while a victim was written back */
+    }
+
+    if (data != NULL)
+    {
+        pthread_mutex_unlock(&_cache->_lock);
+        return data;
+    }
+
+    if (slot == -1)
+    {
+        pthread_mutex_unlock(&_cache->_lock);
+        return NULL; /* every buffer is pinned, caller goes to the disk */
+    }
+
+    cacheslot *s = &_cache->_slots[slot];
+
+    data = _cache->_data + (size_t)slot * 4096;
+    s->_pincnt++;
+
+    if (fill)
+    {
+        /* fetch data block without the lock, other threads wanting it wait for the slot */
+        s->_busy = true;
+        pthread_mutex_unlock(&_cache->_lock);
+        assert(block_read(blk_idx, (void *)data) == 0);
+        pthread_mutex_lock(&_cache->_lock);
+        s->_busy = false;
+        pthread_cond_broadcast(&_cache->_io_done);
+    }
+
+    pthread_mutex_unlock(&_cache->_lock);
+
+    return data;
+}
+
+void cache_release(size_t blk_idx, bool dirty)
+{
+    pthread_mutex_lock(&_cache->_lock);
+
+    int slot = cache_find_slot(blk_idx);
+
+    assert(slot != -1 && _cache->_slots[slot]._pincnt > 0);
+
+    _cache->_slots[slot]._pincnt--;
+
+    if (dirty)
+    {
+        _cache->_slots[slot]._dirty = true;
+    }
+
+    pthread_mutex_unlock(&_cache->_lock);
+}
+
+void cache_fill(size_t blk_idx, const uint8_t *data)
+{
+    if (!cache_enabled())
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&_cache->_lock);
+
+    /* a cached copy is at least as recent as the disk */
+    int slot = cache_find_slot(blk_idx) == -1 ? cache_install(blk_idx) : -1;
+
+    if (slot != -1)
+    {
+        memcpy(_cache->_data + (size_t)slot * 4096, data, 4096);
+    }
+
+    pthread_mutex_unlock(&_cache->_lock);
+}
+
+bool cache_prefetch(size_t blk_idx)
+{
+    if (!cache_enabled())
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&_cache->_lock);
+
+    /* nothing to do if cached or on its way already */
+    int slot = cache_hash_lookup(blk_idx) == -1 ? cache_install(blk_idx) : -1;
+
+    if (slot == -1)
+    {
+        pthread_mutex_unlock(&_cache->_lock);
+        return false;
+    }
+
+    cacheslot *s = &_cache->_slots[slot];
+
+    /* not referenced yet, a block nobody reads is the first to go */
+    s->_referenced = false;
+    s->_iov.iov_base = _cache->_data + (size_t)slot * 4096;
+    s->_iov.iov_len = 4096;
+    s->_aio.block = blk_idx;
+    s->_aio.iov = &s->_iov;
+    s->_aio.iovcnt = 1;
+    s->_aio.write = false;
+
+    /* submitting can wait for room in the disk queue, busy keeps other threads off the slot until it is loading */
+    s->_busy = true;
+    pthread_mutex_unlock(&_cache->_lock);
+    block_aio_submit(&s->_aio); /* a failed submit completes the request with an error, caught when waiting */
+    pthread_mutex_lock(&_cache->_lock);
+    s->_busy = false;
+    s->_loading = true;
+    pthread_cond_broadcast(&_cache->_io_done);
+
+    _cache->_stats.prefetches++;
+    pthread_mutex_unlock(&_cache->_lock);
+
+    return true;
+}
+
+int cache_capacity()
+{
+    return _cache->_capacity;
+}
+
+void cache_invalidate(size_t blk_idx)
+{
+    if (!cache_enabled())
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&_cache->_lock);
+
+    int slot = cache_find_slot(blk_idx);
+
+    if (slot != -1)
+    {
+        cache_hash_remove(slot);
+        _cache->_slots[slot]._valid = _cache->_slots[slot]._dirty = false;
+    }
+
+    pthread_mutex_unlock(&_cache->_lock);
+}
+
+int cache_compare_slot_by_blk(const void *a, const void *b)
+{
+    size_t blk_a = _cache->_slots[*(const int *)a]._blk_idx;
+    size_t blk_b = _cache->_slots[*(const int *)b]._blk_idx;
+
+    return (blk_a > blk_b) - (blk_a < blk_b);
+}
+
+int cache_flush()
+{
+    if (!cache_enabled())
+    {
+        return 0;
+    }
+
+    int *dirty_slots = malloc(_cache->_capacity * sizeof(int));
+    int dirty_cnt = 0;
+
+    if (dirty_slots == NULL)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&_cache->_lock);
+
+    for (int i = 0; i < _cache->_capacity; i++)
+    {
+        while (_cache->_slots[i]._loading || _cache->_slots[i]._busy)
+        {
+            cache_wait_slot(i); /* leave no read ahead in flight behind */
+        }
+
+        if (_cache->_slots[i]._valid && _cache->_slots[i]._dirty)
+        {
+            dirty_slots[dirty_cnt++] = i;
+        }
+    }
+
+    /* write in block order so neighbouring dirty blocks go out with a single call */
+    qsort(dirty_slots, dirty_cnt, sizeof(int), cache_compare_slot_by_blk);
+
+    struct iovec iov[CACHE_FLUSH_MAX_IOVS];
+    int i = 0;
+
+    while (i < dirty_cnt)
+    {
+        size_t run_strt_idx = _cache->_slots[dirty_slots[i]]._blk_idx;
+        int iovcnt = 0;
+
+        while (i < dirty_cnt && iovcnt < CACHE_FLUSH_MAX_IOVS &&
+               _cache->_slots[dirty_slots[i]]._blk_idx == run_strt_idx + iovcnt)
+        {
+            iov[iovcnt].iov_base = _cache->_data + (size_t)dirty_slots[i] * 4096;
+            iov[iovcnt].iov_len = 4096;
+            iovcnt++;
+            i++;
+        }
+
+        if (block_writev(run_strt_idx, iov, iovcnt) != 0)
+        {
+            pthread_mutex_unlock(&_cache->_lock);
+            free(dirty_slots);
+            return -1;
+        }
+
+        for (int j = i - iovcnt; j < i; j++)
+        {
+            _cache->_slots[dirty_slots[j]]._dirty = false;
+        }
+    }
+
+    _cache->_stats.writebacks += dirty_cnt;
+    pthread_mutex_unlock(&_cache->_lock);
+    free(dirty_slots);
+
+    return dirty_cnt;
+}
+
+void cache_get_stats(struct fs_cache_stats *stats)
+{
+    pthread_mutex_lock(&_cache->_lock);
+    *stats = _cache->_stats;
+    pthread_mutex_unlock(&_cache->_lock);
+}
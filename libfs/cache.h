@@ -0,0 +1,75 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "fs.h"
+#include "disk.h"
+
+/* number of block buffers unless LIBFS_CACHE_BLOCKS says otherwise (0 disables the cache) */
+#define CACHE_DEFAULT_BLK_CNT 256
+
+/* requests spanning at most this many blocks go through the cache, larger ones stream to the disk */
+#define CACHE_SMALL_IO_BLK_CNT 8
+
+/* most buffers written back by a single vectored call */
+#define CACHE_FLUSH_MAX_IOVS 64
+
+/************************* BUFFER CACHE ********************************/
+
+typedef struct cacheslot
+{
+    size_t _blk_idx;       /* disk block held by this slot */
+    bool _valid;           /* false if the slot holds nothing */
+    bool _dirty;           /* buffer differs from the block on disk */
+    bool _referenced;      /* CLOCK reference bit, set on every access */
+    int _pincnt;           /* slot cannot be evicted while pinned */
+    int _hash_next;        /* next slot in the same bucket, -1 at the end */
+    bool _loading;         /* read ahead in flight, waited for on first access */
+    bool _busy;            /* a thread does I/O on the buffer without the cache lock, waited for on _io_done */
+    struct block_aio _aio; /* the read ahead request and its buffer */
+    struct iovec _iov;
+} cacheslot;
+
+typedef struct cache
+{
+    pthread_mutex_t _lock;   /* guards the rest, cache_pin() and the helpers after cache_get_stats() expect it held */
+    pthread_cond_t _io_done; /* a busy slot became idle */
+    cacheslot *_slots;
+    uint8_t *_data; /* 4096 bytes per slot */
+    int _capacity;
+
+    int *_hash_bucket; /* first slot of each bucket, -1 if empty */
+    int _hash_bucket_cnt;
+    int _clock_hand;
+
+    struct fs_cache_stats _stats;
+} cache;
+
+cache *cache_use(cache *c); /* cache of the calling thread (NULL for the default one), returns the previous one */
+bool cache_init();
+void cache_destroy(); /* drop every buffer, dirty ones included */
+bool cache_enabled();
+bool cache_contains(size_t blk_idx);                    /* lookup that does not count as an access */
+uint8_t *cache_lookup(size_t blk_idx);                  /* pinned buffer of a cached block, NULL on a miss */
+uint8_t *cache_pin(size_t blk_idx);                     /* same with the cache already locked */
+uint8_t *cache_grab(size_t blk_idx, bool fill);         /* pinned buffer of a block, loaded from disk on a miss if fill */
+void cache_release(size_t blk_idx, bool dirty);         /* unpin a buffer, dirty ones are written back later */
+void cache_fill(size_t blk_idx, const uint8_t *data);   /* keep a clean copy of a block just read from disk */
+bool cache_prefetch(size_t blk_idx);                    /* start reading a block in the background, false if not started */
+int cache_capacity();
+void cache_invalidate(size_t blk_idx);                  /* forget a block, even dirty, once it is freed */
+int cache_flush();                                      /* write back dirty blocks, return how many or -1 */
+void cache_get_stats(struct fs_cache_stats *stats);
+int cache_find_slot(size_t blk_idx); /* -1 if the block is not cached, waits for I/O in flight on its slot */
+int cache_hash_lookup(size_t blk_idx); /* same without waiting */
+void cache_wait_slot(int slot);      /* wait for I/O in flight on a slot with the lock dropped, the slot may be reused after */
+void cache_hash_insert(int slot);
+void cache_hash_remove(int slot);
+int cache_evict();                  /* CLOCK victim, -1 if every slot is pinned, may drop the lock to write a victim back */
+int cache_install(size_t blk_idx);  /* bind a slot to a block that is not cached yet, -1 if none or cached meanwhile */
+int cache_compare_slot_by_blk(const void *a, const void *b);
+
+#endif
@@ -1,144 +1,1604 @@
+#define _GNU_SOURCE /* for O_DIRECT */
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+/* <linux/io_uring.h> drags in the kernel's own BLOCK_SIZE */
+#undef BLOCK_SIZE
 #include "disk.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
+/* Maximum number of buffers in one vectored call (Linux UIO_MAXIOV) */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
-/* Disk instance description */
-struct disk {
-	/* File descriptor */
-	int fd;
-	/* Block count */
-	size_t bcount;
-};
+/* Requests the io_uring engine keeps in its submission queue */
+#define URING_ENTRIES 64
+
+/* Threads of the fallback engine */
+#define AIO_WORKER_COUNT 4
+
+/* Aligned buffers of the direct backend, one per concurrent transfer */
+#define DIRECT_POOL_SIZE (AIO_WORKER_COUNT + 4)
+
+/* Blocks each aligned buffer holds, i.e. the largest single transfer */
+#define DIRECT_CHUNK_BLOCKS 16
+
+/* Asynchronous engines */
+enum aio_kind {
+	/* Not started yet, chosen on the first request */
+	AIO_NONE,
+	/* io_uring rings shared with the kernel */
+	AIO_URING,
+	/* Pool of threads doing positional I/O */
+	AIO_THREADS,
+	/* No thread could be started, requests run when submitted */
+	AIO_SYNC,
+};
+
+/* io_uring instance, driven through raw system calls */
+struct uring {
+	int fd;
+	/* Submission queue ring */
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned sq_entries;
+	/* Completion queue ring, may share the submission ring mapping */
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Requests queued but not submitted yet, and submitted not reaped */
+	unsigned pending;
+	unsigned inflight;
+};
+
+/* Asynchronous engine of the open disk */
+struct aio {
+	enum aio_kind kind;
+	pthread_mutex_t lock;
+	/* Signaled when a request is queued for the workers */
+	pthread_cond_t work_cond;
+	/* Signaled when a worker or the io_uring reaper completes requests */
+	pthread_cond_t done_cond;
+	struct uring ring;
+	/* A thread waits in io_uring_enter() without the lock */
+	int reaping;
+	pthread_t workers[AIO_WORKER_COUNT];
+	int nworkers;
+	struct block_aio *head, *tail;
+	int stop;
+};
+
+/* Block-aligned bounce buffers of the direct backend */
+struct bounce_pool {
+	pthread_mutex_t lock;
+	/* Signaled when a buffer is given back */
+	pthread_cond_t cond;
+	void *bufs[DIRECT_POOL_SIZE];
+	/* Stack of the buffers not in use */
+	void *free[DIRECT_POOL_SIZE];
+	int nfree;
+};
+
+/* Slow storage model of the open disk */
+struct throttle {
+	/* Any of the settings below is non-zero */
+	int enabled;
+	/* Access time paid by every request */
+	long long latency_ns;
+	/* Bandwidth in bytes per second, 0 if unlimited */
+	long long bw;
+	/* Requests allowed in flight at once, 0 if unlimited */
+	int qdepth;
+	int inflight;
+	/* When the device is done moving the bytes of the queued requests */
+	long long busy_until;
+	pthread_mutex_t lock;
+	/* Signaled when a request leaves the queue */
+	pthread_cond_t cond;
+};
+
+/* Operations of a backend, picked when the disk is opened */
+struct block_ops {
+	/* Value of LIBFS_DISK_BACKEND selecting the backend */
+	const char *name;
+	/* Set up the disk's fd, map and block count from the image */
+	int (*open)(const char *diskname);
+	/* Release what open() set up */
+	void (*close)(void);
+	/* Transfer a vectored request already checked against the disk */
+	int (*read)(size_t block, const struct iovec *iov, int iovcnt);
+	int (*write)(size_t block, const struct iovec *iov, int iovcnt);
+	/* Make the blocks written so far durable */
+	int (*flush)(void);
+};
+
+/* Disk instance description */
+struct block_disk {
+	/* Backend of the open disk, NULL if no disk is open */
+	const struct block_ops *ops;
+	/* File descriptor */
+	int fd;
+	/* Block count */
+	size_t bcount;
+	/* Whole image in memory (mmap and RAM backends), NULL otherwise */
+	void *map;
+	/* Bounce buffers of the direct backend */
+	struct bounce_pool pool;
+	/* Optional latency, bandwidth and queue depth limits */
+	struct throttle throttle;
+	/* File system layout, 0 until block_set_layout() */
+	size_t root_block;
+	size_t data_block;
+	/* Updated with atomics, transfers complete on several threads */
+	struct block_stats stats;
+	/* Engine serving block_aio_submit() */
+	struct aio aio;
+};
+
+/* A closed disk instance */
+#define BLOCK_DISK_INIT {					\
+	.fd = INVALID_FD,					\
+	.aio = {						\
+		.lock = PTHREAD_MUTEX_INITIALIZER,		\
+		.work_cond = PTHREAD_COND_INITIALIZER,		\
+		.done_cond = PTHREAD_COND_INITIALIZER,		\
+	},							\
+	.pool = {						\
+		.lock = PTHREAD_MUTEX_INITIALIZER,		\
+		.cond = PTHREAD_COND_INITIALIZER,		\
+	},							\
+	.throttle = {						\
+		.lock = PTHREAD_MUTEX_INITIALIZER,		\
+		.cond = PTHREAD_COND_INITIALIZER,		\
+	},							\
+}
+
+/* Instance used by threads that never selected another one */
+static struct block_disk default_disk = BLOCK_DISK_INIT;
+
+/* Disk the calling thread works on, see block_disk_select() */
+static __thread struct block_disk *disk = &default_disk;
+
+static void aio_stop(void);
+
+/*
+ * All transfers are positional and never touch the file offset, so several
+ * threads can do I/O on the open disk at the same time. Short transfers and
+ * EINTR are retried until the whole buffer has been moved.
+ */
+static int pwrite_full(int fd, const void *buf, size_t len, off_t offset)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pwrite(fd, buf, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("pwrite");
+			return -1;
+		}
+
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+static int pread_full(int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pread(fd, buf, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("pread");
+			return -1;
+		}
+
+		if (ret == 0) {
+			block_error("unexpected end of disk image");
+			return -1;
+		}
+
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+static int pwritev_full(int fd, const struct iovec *iov, int iovcnt,
+			off_t offset)
+{
+	ssize_t ret;
+
+	while (iovcnt > 0) {
+		ret = pwritev(fd, iov, iovcnt, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("pwritev");
+			return -1;
+		}
+
+		offset += ret;
+
+		/* Skip the buffers that were written completely */
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		/* Finish a partially written buffer on its own */
+		if (ret > 0) {
+			if (pwrite_full(fd, iov->iov_base + ret,
+					iov->iov_len - ret, offset))
+				return -1;
+			offset += iov->iov_len - ret;
+			iov++;
+			iovcnt--;
+		}
+	}
+
+	return 0;
+}
+
+static int preadv_full(int fd, const struct iovec *iov, int iovcnt,
+		       off_t offset)
+{
+	ssize_t ret;
+
+	while (iovcnt > 0) {
+		ret = preadv(fd, iov, iovcnt, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("preadv");
+			return -1;
+		}
+
+		if (ret == 0) {
+			block_error("unexpected end of disk image");
+			return -1;
+		}
+
+		offset += ret;
+
+		/* Skip the buffers that were filled completely */
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		/* Finish a partially filled buffer on its own */
+		if (ret > 0) {
+			if (pread_full(fd, iov->iov_base + ret,
+				       iov->iov_len - ret, offset))
+				return -1;
+			offset += iov->iov_len - ret;
+			iov++;
+			iovcnt--;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * O_DIRECT requires the user buffers, the file offset and the length to be
+ * block aligned. The caller's buffers are not, so every transfer of the
+ * direct backend is staged in one of a few aligned buffers of
+ * DIRECT_CHUNK_BLOCKS blocks each.
+ */
+static int bounce_pool_init(struct bounce_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < DIRECT_POOL_SIZE; i++) {
+		if (posix_memalign(&pool->bufs[i], BLOCK_SIZE,
+				   DIRECT_CHUNK_BLOCKS * BLOCK_SIZE)) {
+			block_error("cannot allocate aligned buffers");
+			while (i--)
+				free(pool->bufs[i]);
+			return -1;
+		}
+		pool->free[i] = pool->bufs[i];
+	}
+	pool->nfree = DIRECT_POOL_SIZE;
+
+	return 0;
+}
+
+static void bounce_pool_destroy(struct bounce_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < DIRECT_POOL_SIZE; i++) {
+		free(pool->bufs[i]);
+		pool->bufs[i] = NULL;
+	}
+	pool->nfree = 0;
+}
+
+static void *bounce_get(struct bounce_pool *pool)
+{
+	void *buf;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->nfree)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	buf = pool->free[--pool->nfree];
+	pthread_mutex_unlock(&pool->lock);
+
+	return buf;
+}
+
+static void bounce_put(struct bounce_pool *pool, void *buf)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->free[pool->nfree++] = buf;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Copy @len bytes between @buf and the buffers of @iov, starting @off bytes
+ * into them. @to_iov gives the direction.
+ */
+static void iov_copy(const struct iovec *iov, int iovcnt, size_t off,
+		     void *buf, size_t len, int to_iov)
+{
+	size_t n;
+
+	/* Skip the buffers entirely before @off */
+	while (iovcnt > 0 && off >= iov->iov_len) {
+		off -= iov->iov_len;
+		iov++;
+		iovcnt--;
+	}
+
+	while (len > 0 && iovcnt > 0) {
+		n = iov->iov_len - off;
+		if (n > len)
+			n = len;
+
+		if (to_iov)
+			memcpy(iov->iov_base + off, buf, n);
+		else
+			memcpy(buf, iov->iov_base + off, n);
+
+		buf += n;
+		len -= n;
+		off = 0;
+		iov++;
+		iovcnt--;
+	}
+}
+
+/* Transfer a validated vectored request through the bounce buffers */
+static int direct_transferv(size_t block, const struct iovec *iov, int iovcnt,
+			    int write)
+{
+	size_t len = 0, done, n;
+	void *buf;
+	int i, ret = 0;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	buf = bounce_get(&disk->pool);
+
+	for (done = 0; done < len && !ret; done += n) {
+		n = len - done;
+		if (n > DIRECT_CHUNK_BLOCKS * BLOCK_SIZE)
+			n = DIRECT_CHUNK_BLOCKS * BLOCK_SIZE;
+
+		if (write) {
+			iov_copy(iov, iovcnt, done, buf, n, 0);
+			ret = pwrite_full(disk->fd, buf, n,
+					  block * BLOCK_SIZE + done);
+		} else {
+			ret = pread_full(disk->fd, buf, n,
+					 block * BLOCK_SIZE + done);
+			if (!ret)
+				iov_copy(iov, iovcnt, done, buf, n, 1);
+		}
+	}
+
+	bounce_put(&disk->pool, buf);
+
+	return ret;
+}
+
+/*
+ * Some filesystems accept O_DIRECT at open() time and only fail the transfers
+ * with EINVAL, so read the first block to find out.
+ */
+static int direct_probe(int fd)
+{
+	void *buf = disk->pool.bufs[0];
+	ssize_t ret;
+
+	do {
+		ret = pread(fd, buf, BLOCK_SIZE, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		if (errno == EINVAL)
+			block_error("host filesystem refuses O_DIRECT");
+		else
+			perror("pread");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Copy a validated vectored request to (@write) or from the in-memory image */
+static void block_map_copyv(size_t block, const struct iovec *iov, int iovcnt,
+			    int write)
+{
+	void *pos = disk->map + block * BLOCK_SIZE;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		if (write)
+			memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+		else
+			memcpy(iov[i].iov_base, pos, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+}
+
+/*
+ * Open the image file and check its size. Return the file descriptor and set
+ * @bcount, or return -1.
+ */
+static int image_open(const char *diskname, int flags, size_t *bcount)
+{
+	int fd;
+	struct stat st;
+
+	if ((fd = open(diskname, flags, 0644)) < 0) {
+		if (errno == EINVAL && (flags & O_DIRECT))
+			block_error("host filesystem refuses O_DIRECT");
+		else
+			perror("open");
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+
+	/* The disk image's size should be a multiple of the block size */
+	if (st.st_size % BLOCK_SIZE != 0) {
+		block_error("size '%zu' is not multiple of '%d'",
+			    st.st_size, BLOCK_SIZE);
+		close(fd);
+		return -1;
+	}
+
+	*bcount = st.st_size / BLOCK_SIZE;
+
+	return fd;
+}
+
+/* File backend: positional I/O on the image */
+static int file_open(const char *diskname)
+{
+	disk->fd = image_open(diskname, O_RDWR, &disk->bcount);
+
+	return disk->fd < 0 ? -1 : 0;
+}
+
+static void file_close(void)
+{
+	close(disk->fd);
+}
+
+static int file_read(size_t block, const struct iovec *iov, int iovcnt)
+{
+	/* Read the whole range from its position, in one call if possible */
+	return preadv_full(disk->fd, iov, iovcnt, block * BLOCK_SIZE);
+}
+
+static int file_write(size_t block, const struct iovec *iov, int iovcnt)
+{
+	/* Write the whole range at its position, in one call if possible */
+	return pwritev_full(disk->fd, iov, iovcnt, block * BLOCK_SIZE);
+}
+
+static int file_flush(void)
+{
+	if (fsync(disk->fd)) {
+		perror("fsync");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Direct backend: O_DIRECT on the image, through the bounce buffers */
+static int direct_open(const char *diskname)
+{
+	int fd = image_open(diskname, O_RDWR | O_DIRECT, &disk->bcount);
+
+	if (fd < 0)
+		return -1;
+
+	if (bounce_pool_init(&disk->pool)) {
+		close(fd);
+		return -1;
+	}
+
+	if (disk->bcount && direct_probe(fd)) {
+		bounce_pool_destroy(&disk->pool);
+		close(fd);
+		return -1;
+	}
+
+	disk->fd = fd;
+
+	return 0;
+}
+
+static void direct_close(void)
+{
+	bounce_pool_destroy(&disk->pool);
+	close(disk->fd);
+}
+
+static int direct_read(size_t block, const struct iovec *iov, int iovcnt)
+{
+	return direct_transferv(block, iov, iovcnt, 0);
+}
+
+static int direct_write(size_t block, const struct iovec *iov, int iovcnt)
+{
+	return direct_transferv(block, iov, iovcnt, 1);
+}
+
+/* Mmap backend: memcpy against a shared mapping of the image */
+static int mmap_open(const char *diskname)
+{
+	int fd = image_open(diskname, O_RDWR, &disk->bcount);
+
+	if (fd < 0)
+		return -1;
+
+	disk->map = mmap(NULL, disk->bcount * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (disk->map == MAP_FAILED) {
+		perror("mmap");
+		disk->map = NULL;
+		close(fd);
+		return -1;
+	}
+
+	disk->fd = fd;
+
+	return 0;
+}
+
+static int mmap_flush(void)
+{
+	if (msync(disk->map, disk->bcount * BLOCK_SIZE, MS_SYNC)) {
+		perror("msync");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void mmap_close(void)
+{
+	/* Push the dirty pages back to the image before dropping them */
+	mmap_flush();
+	munmap(disk->map, disk->bcount * BLOCK_SIZE);
+	close(disk->fd);
+}
+
+static int map_read(size_t block, const struct iovec *iov, int iovcnt)
+{
+	block_map_copyv(block, iov, iovcnt, 0);
+	return 0;
+}
+
+static int map_write(size_t block, const struct iovec *iov, int iovcnt)
+{
+	block_map_copyv(block, iov, iovcnt, 1);
+	return 0;
+}
+
+/* RAM backend: private copy of the image, the file itself is never written */
+static int ram_open(const char *diskname)
+{
+	int fd = image_open(diskname, O_RDONLY, &disk->bcount);
+
+	if (fd < 0)
+		return -1;
+
+	/* Keep a valid pointer even for an empty image */
+	disk->map = malloc(disk->bcount ? disk->bcount * BLOCK_SIZE : 1);
+	if (!disk->map) {
+		block_error("cannot allocate %zu blocks", disk->bcount);
+		close(fd);
+		return -1;
+	}
+
+	if (pread_full(fd, disk->map, disk->bcount * BLOCK_SIZE, 0)) {
+		free(disk->map);
+		disk->map = NULL;
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+static void ram_close(void)
+{
+	free(disk->map);
+}
+
+static int ram_flush(void)
+{
+	return 0;
+}
+
+static const struct block_ops block_backends[] = {
+	[BLOCK_BACKEND_FILE] = {
+		.name = "file",
+		.open = file_open,
+		.close = file_close,
+		.read = file_read,
+		.write = file_write,
+		.flush = file_flush,
+	},
+	[BLOCK_BACKEND_MMAP] = {
+		.name = "mmap",
+		.open = mmap_open,
+		.close = mmap_close,
+		.read = map_read,
+		.write = map_write,
+		.flush = mmap_flush,
+	},
+	[BLOCK_BACKEND_DIRECT] = {
+		.name = "direct",
+		.open = direct_open,
+		.close = direct_close,
+		.read = direct_read,
+		.write = direct_write,
+		.flush = file_flush,
+	},
+	[BLOCK_BACKEND_RAM] = {
+		.name = "ram",
+		.open = ram_open,
+		.close = ram_close,
+		.read = map_read,
+		.write = map_write,
+		.flush = ram_flush,
+	},
+};
+
+#define BLOCK_BACKEND_COUNT \
+	(int)(sizeof(block_backends) / sizeof(block_backends[0]))
+
+/*
+ * Slow storage model, set from the environment when the disk is opened. Every
+ * transfer first waits for one of @qdepth slots, then for the device: requests
+ * move their bytes one after the other at @bw bytes per second, and each one
+ * also pays @latency_ns of access time, which overlaps with other requests in
+ * flight. Merging blocks into fewer requests therefore saves latency, and
+ * keeping several requests in flight hides it.
+ */
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Read a non-negative integer setting, 0 if unset */
+static long long throttle_env(const char *name)
+{
+	const char *val = getenv(name);
+	long long ret;
+
+	if (!val)
+		return 0;
+
+	ret = atoll(val);
+	if (ret < 0) {
+		block_error("ignoring negative %s", name);
+		return 0;
+	}
+
+	return ret;
+}
+
+static void throttle_setup(struct throttle *t)
+{
+	t->latency_ns = throttle_env("LIBFS_DISK_LATENCY_US") * 1000;
+	t->bw = throttle_env("LIBFS_DISK_BW_KBPS") * 1024;
+	t->qdepth = throttle_env("LIBFS_DISK_QDEPTH");
+	t->inflight = 0;
+	t->busy_until = 0;
+	t->enabled = t->latency_ns || t->bw || t->qdepth;
+}
+
+/* Wait until a request of @len bytes would have completed on the device */
+static void throttle_enter(struct throttle *t, size_t len)
+{
+	long long start, deadline;
+	struct timespec ts;
+
+	pthread_mutex_lock(&t->lock);
+
+	while (t->qdepth && t->inflight >= t->qdepth)
+		pthread_cond_wait(&t->cond, &t->lock);
+	t->inflight++;
+
+	start = now_ns();
+	if (t->bw) {
+		if (t->busy_until > start)
+			start = t->busy_until;
+		t->busy_until = start + len * 1000000000LL / t->bw;
+		start = t->busy_until;
+	}
+	deadline = start + t->latency_ns;
+
+	pthread_mutex_unlock(&t->lock);
+
+	ts.tv_sec = deadline / 1000000000LL;
+	ts.tv_nsec = deadline % 1000000000LL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static void throttle_exit(struct throttle *t)
+{
+	pthread_mutex_lock(&t->lock);
+	t->inflight--;
+	pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+}
+
+static enum block_category block_category(size_t block)
+{
+	if (block == 0)
+		return BLOCK_CAT_SUPER;
+	if (!disk->data_block || block >= disk->data_block)
+		return BLOCK_CAT_DATA;
+	if (block == disk->root_block)
+		return BLOCK_CAT_ROOT;
+
+	return BLOCK_CAT_FAT;
+}
+
+/* Count a request that moved @len bytes from @block in @ns nanoseconds */
+static void stats_record(size_t block, size_t len, int write, long long ns)
+{
+	struct block_io_stats *st = &disk->stats.cat[block_category(block)];
+	long long us = ns / 1000;
+	int bucket = 0;
+
+	while (us > 1 && bucket < BLOCK_STATS_LAT_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	if (write) {
+		__atomic_fetch_add(&st->writes, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&st->bytes_written, len, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&st->reads, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&st->bytes_read, len, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_add(&st->lat_hist[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/* Transfer a request already checked against the disk, throttled if asked */
+static int disk_transfer(size_t block, const struct iovec *iov, int iovcnt,
+			 int write)
+{
+	long long start = now_ns();
+	size_t len = 0;
+	int i, ret;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (disk->throttle.enabled)
+		throttle_enter(&disk->throttle, len);
+
+	ret = write ? disk->ops->write(block, iov, iovcnt) :
+		disk->ops->read(block, iov, iovcnt);
+
+	if (disk->throttle.enabled)
+		throttle_exit(&disk->throttle);
+
+	if (!ret)
+		stats_record(block, len, write, now_ns() - start);
+
+	return ret;
+}
+
+struct block_disk *block_disk_new(void)
+{
+	struct block_disk *d = malloc(sizeof(*d));
+
+	if (!d) {
+		block_error("cannot allocate disk");
+		return NULL;
+	}
+
+	*d = (struct block_disk)BLOCK_DISK_INIT;
+
+	return d;
+}
+
+void block_disk_free(struct block_disk *d)
+{
+	if (!d || d == &default_disk)
+		return;
+
+	if (d->ops)
+		block_error("freeing a disk still open");
+
+	if (disk == d)
+		disk = &default_disk;
+
+	free(d);
+}
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+struct block_disk *block_disk_select(struct block_disk *d)
+{
+	struct block_disk *prev = disk;
+
+	disk = d ? d : &default_disk;
+
+	return prev;
+}
+
+/* Finish opening the disk once @backend holds the image */
+static void disk_opened(enum block_backend backend)
+{
+	disk->ops = &block_backends[backend];
+	disk->root_block = disk->data_block = 0;
+	throttle_setup(&disk->throttle);
+	block_stats_reset();
+}
 
 int block_disk_open(const char *diskname)
 {
-	int fd;
-	struct stat st;
+	const char *name = getenv("LIBFS_DISK_BACKEND");
+	int i;
+
+	/* The backend can be picked without changing the callers */
+	if (!name)
+		return block_disk_open_backend(diskname, BLOCK_BACKEND_FILE);
+
+	for (i = 0; i < BLOCK_BACKEND_COUNT; i++)
+		if (!strcmp(name, block_backends[i].name))
+			return block_disk_open_backend(diskname, i);
+
+	block_error("unknown backend '%s'", name);
+	return -1;
+}
 
+int block_disk_open_backend(const char *diskname, enum block_backend backend)
+{
 	if (!diskname) {
 		block_error("invalid file diskname");
 		return -1;
 	}
 
-	if (disk.fd != INVALID_FD) {
+	if (disk->ops) {
 		block_error("disk already open");
 		return -1;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
-		perror("open");
+	if ((int)backend < 0 || (int)backend >= BLOCK_BACKEND_COUNT) {
+		block_error("unknown backend (%d)", backend);
 		return -1;
 	}
 
-	if (fstat(fd, &st)) {
-		perror("fstat");
+	disk->fd = INVALID_FD;
+	disk->map = NULL;
+
+	if (block_backends[backend].open(diskname))
+		return -1;
+
+	disk_opened(backend);
+
+	return 0;
+}
+
+int block_disk_open_ram(size_t bcount)
+{
+	if (disk->ops) {
+		block_error("disk already open");
 		return -1;
 	}
 
-	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
-		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+	disk->fd = INVALID_FD;
+	disk->bcount = bcount;
+
+	/* Keep a valid pointer even for an empty disk */
+	disk->map = calloc(bcount ? bcount : 1, BLOCK_SIZE);
+	if (!disk->map) {
+		block_error("cannot allocate %zu blocks", bcount);
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk_opened(BLOCK_BACKEND_RAM);
 
 	return 0;
 }
 
 int block_disk_close(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk->ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	aio_stop();
 
-	disk.fd = INVALID_FD;
+	disk->ops->close();
+
+	disk->ops = NULL;
+	disk->fd = INVALID_FD;
+	disk->map = NULL;
 
 	return 0;
 }
 
+int block_disk_sync(void)
+{
+	if (!disk->ops) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	return disk->ops->flush();
+}
+
+void *block_ptr(size_t block)
+{
+	if (!disk->ops || !disk->map) {
+		block_error("no mapped disk currently open");
+		return NULL;
+	}
+
+	if (block >= disk->bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, disk->bcount);
+		return NULL;
+	}
+
+	return disk->map + block * BLOCK_SIZE;
+}
+
 int block_disk_count(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk->ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	return disk.bcount;
+	return disk->bcount;
 }
 
 int block_write(size_t block, const void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	struct iovec iov = {
+		.iov_base = (void *)buf,
+		.iov_len = BLOCK_SIZE,
+	};
+
+	if (!disk->ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
+	if (block >= disk->bcount) {
 		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+			    block, disk->bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	/* Perform the actual write at the block's position in the disk image */
+	return disk_transfer(block, &iov, 1, 1);
+}
+
+int block_read(size_t block, void *buf)
+{
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = BLOCK_SIZE,
+	};
+
+	if (!disk->ops) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	if (block >= disk->bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, disk->bcount);
 		return -1;
 	}
 
-	return 0;
+	/* Perform the actual read from the block's position in the disk image */
+	return disk_transfer(block, &iov, 1, 0);
 }
 
-int block_read(size_t block, void *buf)
+/* Validate a vectored request and return its length in blocks, or -1 */
+static ssize_t block_iov_count(size_t block, const struct iovec *iov,
+			       int iovcnt)
 {
-	if (disk.fd == INVALID_FD) {
+	size_t len = 0;
+	int i;
+
+	if (!disk->ops) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+		block_error("invalid iovec count (%d)", iovcnt);
+		return -1;
+	}
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (len % BLOCK_SIZE != 0) {
+		block_error("length '%zu' is not multiple of '%d'",
+			    len, BLOCK_SIZE);
+		return -1;
+	}
+
+	if (block + len / BLOCK_SIZE > disk->bcount) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, len / BLOCK_SIZE, disk->bcount);
+		return -1;
+	}
+
+	return len / BLOCK_SIZE;
+}
+
+int block_writev(size_t block, const struct iovec *iov, int iovcnt)
+{
+	if (block_iov_count(block, iov, iovcnt) < 0)
+		return -1;
+
+	return disk_transfer(block, iov, iovcnt, 1);
+}
+
+int block_readv(size_t block, const struct iovec *iov, int iovcnt)
+{
+	if (block_iov_count(block, iov, iovcnt) < 0)
+		return -1;
+
+	return disk_transfer(block, iov, iovcnt, 0);
+}
+
+int block_set_layout(size_t root_block, size_t data_block)
+{
+	if (!disk->ops) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (root_block == 0 || data_block <= root_block ||
+	    data_block > disk->bcount) {
+		block_error("invalid layout (root %zu, data %zu/%zu)",
+			    root_block, data_block, disk->bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	disk->root_block = root_block;
+	disk->data_block = data_block;
+
+	return 0;
+}
+
+int block_stats_snapshot(struct block_stats *stats)
+{
+	unsigned long long *src = (unsigned long long *)&disk->stats;
+	unsigned long long *dst = (unsigned long long *)stats;
+	size_t i;
+
+	if (!stats) {
+		block_error("invalid stats buffer");
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	for (i = 0; i < sizeof(*stats) / sizeof(*src); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+void block_stats_reset(void)
+{
+	unsigned long long *cnt = (unsigned long long *)&disk->stats;
+	size_t i;
+
+	for (i = 0; i < sizeof(disk->stats) / sizeof(*cnt); i++)
+		__atomic_store_n(&cnt[i], 0, __ATOMIC_RELAXED);
+}
+
+int block_write_range(size_t block, size_t count, const void *buf)
+{
+	struct iovec iov = {
+		.iov_base = (void *)buf,
+		.iov_len = count * BLOCK_SIZE,
+	};
+
+	return block_writev(block, &iov, 1);
+}
+
+int block_read_range(size_t block, size_t count, void *buf)
+{
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = count * BLOCK_SIZE,
+	};
+
+	return block_readv(block, &iov, 1);
+}
+
+static int uring_setup(struct uring *r)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (r->fd < 0)
 		return -1;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+
+	/* Newer kernels map both rings with a single mmap() */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size)
+			r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = r->sq_ring_size;
+	}
+
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED)
+		goto err_fd;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, r->fd,
+				  IORING_OFF_CQ_RING);
+		if (r->cq_ring == MAP_FAILED)
+			goto err_sq;
+	}
+
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto err_cq;
+
+	r->sq_head = r->sq_ring + p.sq_off.head;
+	r->sq_tail = r->sq_ring + p.sq_off.tail;
+	r->sq_mask = r->sq_ring + p.sq_off.ring_mask;
+	r->sq_array = r->sq_ring + p.sq_off.array;
+	r->sq_entries = p.sq_entries;
+	r->cq_head = r->cq_ring + p.cq_off.head;
+	r->cq_tail = r->cq_ring + p.cq_off.tail;
+	r->cq_mask = r->cq_ring + p.cq_off.ring_mask;
+	r->cqes = r->cq_ring + p.cq_off.cqes;
+	r->pending = r->inflight = 0;
+
+	return 0;
+
+err_cq:
+	if (r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+err_sq:
+	munmap(r->sq_ring, r->sq_ring_size);
+err_fd:
+	close(r->fd);
+	return -1;
+}
+
+static void uring_teardown(struct uring *r)
+{
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+}
+
+/* Length in bytes of a request's buffers */
+static size_t aio_len(const struct block_aio *req)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < req->iovcnt; i++)
+		len += req->iov[i].iov_len;
+
+	return len;
+}
+
+/* Do a request synchronously */
+static int aio_run(const struct block_aio *req)
+{
+	return disk_transfer(req->block, req->iov, req->iovcnt, req->write);
+}
+
+/*
+ * Hand @to_submit queued requests to the kernel and wait for @min_complete
+ * completions, return how many requests the kernel took or -1
+ */
+static int uring_enter(struct uring *r, unsigned to_submit,
+		       unsigned min_complete)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, r->fd, to_submit,
+			      min_complete,
+			      min_complete ? IORING_ENTER_GETEVENTS : 0,
+			      NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		perror("io_uring_enter");
+
+	return ret;
+}
+
+/*
+ * Complete the requests the kernel is done with, return the short or failed
+ * ones chained through their next field, to be redone by aio_redo()
+ */
+static struct block_aio *uring_reap(struct uring *r)
+{
+	unsigned head = *r->cq_head;
+	struct io_uring_cqe *cqe;
+	struct block_aio *req, *failed = NULL;
+
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &r->cqes[head & *r->cq_mask];
+		req = (struct block_aio *)(unsigned long)cqe->user_data;
+
+		if (cqe->res >= 0 && (size_t)cqe->res == aio_len(req)) {
+			req->result = 0;
+			req->done = 1;
+			stats_record(req->block, cqe->res, req->write,
+				     now_ns() - req->start_ns);
+		} else {
+			req->next = failed;
+			failed = req;
+		}
+
+		head++;
+		r->inflight--;
+	}
+
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+	return failed;
+}
+
+/*
+ * Redo @failed requests synchronously, called with the engine lock held.
+ * The lock is dropped meanwhile so that a slow retry holds no other request.
+ */
+static void aio_redo(struct block_aio *failed)
+{
+	struct block_aio *req, *next;
+
+	pthread_mutex_unlock(&disk->aio.lock);
+	for (req = failed; req; req = req->next)
+		req->result = aio_run(req);
+	pthread_mutex_lock(&disk->aio.lock);
+
+	/* A request may be freed as soon as it is done */
+	for (req = failed; req; req = next) {
+		next = req->next;
+		req->done = 1;
+	}
+
+	pthread_cond_broadcast(&disk->aio.done_cond);
+}
+
+/*
+ * Wait for some requests to complete, called with the engine lock held.
+ *
+ * One thread at a time waits in the kernel with the lock dropped, so others
+ * can keep queueing requests meanwhile. It reaps every completion it finds
+ * and wakes the other waiters, which only push their queued requests to the
+ * kernel and sleep until then. With nothing in the rings, the requests not
+ * done yet are being redone by aio_redo(), which wakes the waiters as well.
+ */
+static int uring_wait(struct uring *r)
+{
+	unsigned to_submit = r->pending;
+	struct block_aio *failed = NULL;
+	int ret;
+
+	if (disk->aio.reaping || !(r->pending + r->inflight)) {
+		if (r->pending) {
+			ret = uring_enter(r, r->pending, 0);
+			if (ret < 0)
+				return -1;
+			r->pending -= ret;
+			r->inflight += ret;
+		}
+		pthread_cond_wait(&disk->aio.done_cond, &disk->aio.lock);
+		return 0;
+	}
+
+	disk->aio.reaping = 1;
+	pthread_mutex_unlock(&disk->aio.lock);
+	ret = uring_enter(r, to_submit, 1);
+	pthread_mutex_lock(&disk->aio.lock);
+	disk->aio.reaping = 0;
+
+	if (ret >= 0) {
+		r->pending -= ret;
+		r->inflight += ret;
+		failed = uring_reap(r);
 	}
 
+	pthread_cond_broadcast(&disk->aio.done_cond);
+
+	if (failed)
+		aio_redo(failed);
+
+	return ret < 0 ? -1 : 0;
+}
+
+static int uring_queue(struct uring *r, struct block_aio *req)
+{
+	unsigned tail, idx;
+	struct io_uring_sqe *sqe;
+
+	/* Keep everything outstanding within what the rings can hold */
+	while (r->pending + r->inflight >= r->sq_entries)
+		if (uring_wait(r))
+			return -1;
+
+	tail = *r->sq_tail;
+	idx = tail & *r->sq_mask;
+	sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = disk->fd;
+	sqe->addr = (unsigned long)req->iov;
+	sqe->len = req->iovcnt;
+	sqe->off = req->block * BLOCK_SIZE;
+	sqe->user_data = (unsigned long)req;
+	req->start_ns = now_ns();
+
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->pending++;
+
 	return 0;
 }
 
+static void *aio_worker(void *arg)
+{
+	/* Serve the disk that started the engine */
+	disk = arg;
+
+	struct block_aio *req;
+	int result;
+
+	pthread_mutex_lock(&disk->aio.lock);
+
+	while (1) {
+		while (!disk->aio.head && !disk->aio.stop)
+			pthread_cond_wait(&disk->aio.work_cond, &disk->aio.lock);
+
+		if (!disk->aio.head)
+			break;
+
+		req = disk->aio.head;
+		disk->aio.head = req->next;
+		if (!disk->aio.head)
+			disk->aio.tail = NULL;
+
+		pthread_mutex_unlock(&disk->aio.lock);
+		result = aio_run(req);
+		pthread_mutex_lock(&disk->aio.lock);
+
+		req->result = result;
+		req->done = 1;
+		pthread_cond_broadcast(&disk->aio.done_cond);
+	}
+
+	pthread_mutex_unlock(&disk->aio.lock);
+
+	return NULL;
+}
+
+/* Pick and start an engine, called with the engine lock held */
+static void aio_start(void)
+{
+	const char *name = getenv("LIBFS_DISK_AIO");
+	int i;
+
+	/*
+	 * io_uring hands the caller's buffers straight to the image file, which
+	 * only the plain file backend does itself, and bypasses the throttling
+	 */
+	if (disk->ops != &block_backends[BLOCK_BACKEND_FILE] ||
+	    disk->throttle.enabled)
+		name = "threads";
+
+	if ((!name || strcmp(name, "threads")) && !uring_setup(&disk->aio.ring)) {
+		disk->aio.kind = AIO_URING;
+		return;
+	}
+
+	if (name && !strcmp(name, "uring"))
+		block_error("io_uring unavailable, using threads");
+
+	disk->aio.kind = AIO_THREADS;
+	disk->aio.stop = 0;
+	disk->aio.head = disk->aio.tail = NULL;
+	for (i = 0; i < AIO_WORKER_COUNT; i++)
+		if (pthread_create(&disk->aio.workers[i], NULL, aio_worker,
+				   disk))
+			break;
+	disk->aio.nworkers = i;
+
+	if (!i) {
+		block_error("no aio worker could be started, using sync I/O");
+		disk->aio.kind = AIO_SYNC;
+	}
+}
+
+static void aio_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&disk->aio.lock);
+
+	if (disk->aio.kind == AIO_URING) {
+		/* Let the kernel finish with our buffers first */
+		while (disk->aio.ring.pending + disk->aio.ring.inflight)
+			if (uring_wait(&disk->aio.ring))
+				break;
+		uring_teardown(&disk->aio.ring);
+	} else if (disk->aio.kind == AIO_THREADS) {
+		disk->aio.stop = 1;
+		pthread_cond_broadcast(&disk->aio.work_cond);
+		pthread_mutex_unlock(&disk->aio.lock);
+		for (i = 0; i < disk->aio.nworkers; i++)
+			pthread_join(disk->aio.workers[i], NULL);
+		pthread_mutex_lock(&disk->aio.lock);
+	}
+
+	disk->aio.kind = AIO_NONE;
+
+	pthread_mutex_unlock(&disk->aio.lock);
+}
+
+int block_aio_submit(struct block_aio *req)
+{
+	int ret = 0;
+
+	req->done = 0;
+	req->next = NULL;
+
+	if (block_iov_count(req->block, req->iov, req->iovcnt) < 0) {
+		req->result = -1;
+		req->done = 1;
+		return -1;
+	}
+
+	/* An image in memory has nothing to wait for, unless it is throttled */
+	if (disk->map && !disk->throttle.enabled) {
+		req->result = aio_run(req);
+		req->done = 1;
+		return 0;
+	}
+
+	pthread_mutex_lock(&disk->aio.lock);
+
+	if (disk->aio.kind == AIO_NONE)
+		aio_start();
+
+	if (disk->aio.kind == AIO_URING) {
+		ret = uring_queue(&disk->aio.ring, req);
+	} else if (disk->aio.kind == AIO_SYNC) {
+		pthread_mutex_unlock(&disk->aio.lock);
+		req->result = aio_run(req);
+		req->done = 1;
+		return 0;
+	} else {
+		if (disk->aio.tail)
+			disk->aio.tail->next = req;
+		else
+			disk->aio.head = req;
+		disk->aio.tail = req;
+		pthread_cond_signal(&disk->aio.work_cond);
+	}
+
+	pthread_mutex_unlock(&disk->aio.lock);
+
+	if (ret) {
+		req->result = -1;
+		req->done = 1;
+	}
+
+	return ret;
+}
+
+int block_aio_wait(struct block_aio *req)
+{
+	pthread_mutex_lock(&disk->aio.lock);
+
+	while (!req->done) {
+		if (disk->aio.kind == AIO_URING) {
+			if (uring_wait(&disk->aio.ring))
+				break;
+		} else {
+			pthread_cond_wait(&disk->aio.done_cond, &disk->aio.lock);
+		}
+	}
+
+	pthread_mutex_unlock(&disk->aio.lock);
+
+	return req->done ? req->result : -1;
+}
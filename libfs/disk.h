@@ -1,11 +1,62 @@
 #ifndef _DISK_H
 #define _DISK_H
 
-#include <stddef.h> /* for size_t definition */
+#include <stddef.h>  /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** Ways of accessing the virtual disk file */
+enum block_backend {
+	/* pread/pwrite on the image file */
+	BLOCK_BACKEND_FILE,
+	/* memcpy against a shared mapping of the whole image */
+	BLOCK_BACKEND_MMAP,
+	/* O_DIRECT on the image file, bounced through aligned buffers */
+	BLOCK_BACKEND_DIRECT,
+	/* Private copy of the image in memory, discarded when closed */
+	BLOCK_BACKEND_RAM,
+};
+
+/** Virtual disk instance */
+struct block_disk;
+
+/**
+ * block_disk_new - Create a disk instance
+ *
+ * Every thread starts on a default instance, which is all a process working
+ * on a single virtual disk needs. Additional instances let one process keep
+ * several virtual disks open at once, see block_disk_select().
+ *
+ * Return: a new closed instance, or NULL if it cannot be allocated.
+ */
+struct block_disk *block_disk_new(void);
+
+/**
+ * block_disk_free - Destroy a disk instance
+ * @d: Instance returned by block_disk_new()
+ *
+ * @d must be closed. Threads that selected @d must select another instance
+ * before their next call; the calling thread falls back to the default one.
+ */
+void block_disk_free(struct block_disk *d);
+
+/**
+ * block_disk_select - Pick the disk instance of the calling thread
+ * @d: Instance to work on, or NULL for the default one
+ *
+ * Every other block_* function acts on the instance selected by the calling
+ * thread. Several threads can select the same instance and transfer blocks
+ * through it at once: the reads and writes are positional, the statistics are
+ * updated atomically, and the asynchronous engine, the throttle and the bounce
+ * buffers of %BLOCK_BACKEND_DIRECT each have a lock of their own. Opening,
+ * closing and freeing an instance must not overlap any other call on it.
+ *
+ * Return: the instance previously selected.
+ */
+struct block_disk *block_disk_select(struct block_disk *d);
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -14,11 +65,53 @@
  * blocks can be read from it with block_read() or written to it with
  * block_write().
  *
- * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
- * or is already open. 0 otherwise.
+ * The backend is taken from the environment variable LIBFS_DISK_BACKEND
+ * ("file", "mmap", "direct" or "ram"), and is %BLOCK_BACKEND_FILE if the
+ * variable is not set.
+ *
+ * Slow storage can be modelled with three more variables, all unset by
+ * default: LIBFS_DISK_LATENCY_US adds an access time to every request,
+ * LIBFS_DISK_BW_KBPS caps the transfer rate in KiB per second, and
+ * LIBFS_DISK_QDEPTH limits how many requests are in flight at once. They apply
+ * to every backend and also to block_disk_open_backend().
+ *
+ * Return: -1 if @diskname is invalid, if the backend is unknown, if the virtual
+ * disk file cannot be opened or is already open. 0 otherwise.
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_backend - Open virtual disk file with a given backend
+ * @diskname: Name of the virtual disk file
+ * @backend: How blocks are accessed
+ *
+ * Same as block_disk_open(), with an explicit backend. With
+ * %BLOCK_BACKEND_MMAP, the whole image is mapped in memory and block_ptr() can
+ * be used to access blocks directly. With %BLOCK_BACKEND_DIRECT, the image is
+ * opened with O_DIRECT so transfers bypass the host page cache; every transfer
+ * then goes through a small pool of block-aligned buffers, whatever the
+ * alignment of the caller's buffers. With %BLOCK_BACKEND_RAM, the image is
+ * loaded in memory when opened and the file is never written: every change is
+ * lost when the disk is closed, and block_ptr() can be used as well.
+ *
+ * Return: -1 if @diskname is invalid, if the virtual disk file cannot be opened
+ * or mapped, if the host filesystem refuses O_DIRECT, or if the disk is already
+ * open. 0 otherwise.
+ */
+int block_disk_open_backend(const char *diskname, enum block_backend backend);
+
+/**
+ * block_disk_open_ram - Open an empty disk held in memory
+ * @bcount: Number of blocks of the disk
+ *
+ * Like block_disk_open_backend() with %BLOCK_BACKEND_RAM, but no image file is
+ * read: the disk starts with @bcount blocks of zeros and nothing on the host
+ * filesystem is touched. Everything written is lost when the disk is closed.
+ *
+ * Return: -1 if the disk is already open or cannot be allocated. 0 otherwise.
+ */
+int block_disk_open_ram(size_t bcount);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -26,6 +119,18 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_sync - Flush virtual disk file
+ *
+ * Make sure every block written so far has reached the virtual disk file (with
+ * msync() for a mapped disk, fsync() otherwise). A mapped disk is also flushed
+ * by block_disk_close(). Nothing is done for a RAM disk.
+ *
+ * Return: -1 if there was no virtual disk file opened or if flushing fails. 0
+ * otherwise.
+ */
+int block_disk_sync(void);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -60,5 +165,189 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_ptr - Get direct access to a block
+ * @block: Index of the block
+ *
+ * Return a pointer to the %BLOCK_SIZE bytes of block @block in the memory of a
+ * disk opened with %BLOCK_BACKEND_MMAP or %BLOCK_BACKEND_RAM. Writes through
+ * the pointer go to the disk like block_write() does. The pointer is valid
+ * until block_disk_close().
+ *
+ * Return: NULL if there is no mapped or RAM disk open or if @block is out of
+ * bounds. The address of the block otherwise.
+ */
+void *block_ptr(size_t block);
+
+/**
+ * block_writev - Write contiguous blocks to disk from a gather list
+ * @block: Index of the first block to write to
+ * @iov: Buffers holding the data, in block order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Write the content of the buffers described by @iov into the virtual disk's
+ * blocks starting at @block, with a single system call. The total length of
+ * @iov must be a multiple of %BLOCK_SIZE; individual buffers need not be.
+ *
+ * Return: -1 if @iovcnt is invalid, if the total length is not a multiple of
+ * %BLOCK_SIZE, if any of the blocks is out of bounds or inaccessible or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_writev(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_readv - Read contiguous blocks from disk into a scatter list
+ * @block: Index of the first block to read from
+ * @iov: Buffers to be filled, in block order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Read the virtual disk's blocks starting at @block into the buffers
+ * described by @iov, with a single system call. The total length of @iov
+ * must be a multiple of %BLOCK_SIZE; individual buffers need not be.
+ *
+ * Return: -1 if @iovcnt is invalid, if the total length is not a multiple of
+ * %BLOCK_SIZE, if any of the blocks is out of bounds or inaccessible or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_readv(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_write_range - Write contiguous blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count * %BLOCK_SIZE bytes) in the virtual
+ * disk's blocks @block to @block + @count - 1.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_write_range(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_range - Read contiguous blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count * %BLOCK_SIZE bytes) into buffer @buf.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_read_range(size_t block, size_t count, void *buf);
+
+/** Asynchronous block request */
+struct block_aio {
+	/* Index of the first block to transfer */
+	size_t block;
+	/* Buffers covering a multiple of %BLOCK_SIZE bytes, as for block_readv() */
+	const struct iovec *iov;
+	int iovcnt;
+	/* Non-zero to write the buffers to disk, zero to read into them */
+	int write;
+	/* 0 on success or -1, valid once the request is done */
+	int result;
+	/* Private to the disk layer */
+	int done;
+	struct block_aio *next;
+	long long start_ns;
+};
+
+/**
+ * block_aio_submit - Start an asynchronous block transfer
+ * @req: Request to start
+ *
+ * Queue the transfer described by @req and return without waiting for it. Many
+ * requests can be in flight at once; they are served by io_uring when the
+ * kernel allows it, and by a pool of I/O threads otherwise (the environment
+ * variable LIBFS_DISK_AIO can force "uring" or "threads"). @req and its buffers
+ * must stay valid until block_aio_wait() returns for it, and every submitted
+ * request must be waited for before block_disk_close().
+ *
+ * Return: -1 if @req is invalid (see block_readv()) or cannot be queued, in
+ * which case it is already complete with a result of -1. 0 otherwise.
+ */
+int block_aio_submit(struct block_aio *req);
+
+/**
+ * block_aio_wait - Wait for an asynchronous block transfer
+ * @req: Request previously passed to block_aio_submit()
+ *
+ * Block until @req has completed, reaping any other completion on the way.
+ *
+ * Return: -1 if the transfer failed. 0 otherwise.
+ */
+int block_aio_wait(struct block_aio *req);
+
+/** Kinds of blocks told apart by the I/O statistics */
+enum block_category {
+	/* Block 0 */
+	BLOCK_CAT_SUPER,
+	/* Blocks between the superblock and the root directory */
+	BLOCK_CAT_FAT,
+	BLOCK_CAT_ROOT,
+	/* Every block from the first data block on */
+	BLOCK_CAT_DATA,
+	BLOCK_CAT_COUNT,
+};
+
+/** Number of buckets of the latency histograms */
+#define BLOCK_STATS_LAT_BUCKETS 20
+
+/** I/O counters of one category of blocks */
+struct block_io_stats {
+	/* Requests, however many blocks each one moves */
+	unsigned long long reads;
+	unsigned long long writes;
+	unsigned long long bytes_read;
+	unsigned long long bytes_written;
+	/*
+	 * Requests by latency: bucket i counts the ones that took from 2^i up to
+	 * 2^(i+1) microseconds, bucket 0 also the faster ones and the last bucket
+	 * also the slower ones
+	 */
+	unsigned long long lat_hist[BLOCK_STATS_LAT_BUCKETS];
+};
+
+/** I/O counters of the virtual disk */
+struct block_stats {
+	struct block_io_stats cat[BLOCK_CAT_COUNT];
+};
+
+/**
+ * block_set_layout - Describe the file system layout to the statistics
+ * @root_block: Index of the root directory block
+ * @data_block: Index of the first data block
+ *
+ * Let the I/O statistics classify blocks by what they hold: the superblock is
+ * block 0 and the FAT lies between it and @root_block. Until this is called,
+ * every block but block 0 counts as a data block. The layout is forgotten when
+ * the disk is closed.
+ *
+ * Return: -1 if no disk is open or if the layout is out of bounds. 0 otherwise.
+ */
+int block_set_layout(size_t root_block, size_t data_block);
+
+/**
+ * block_stats_snapshot - Get the I/O statistics
+ * @stats: Filled with a copy of the counters
+ *
+ * Every transfer, synchronous or not, is counted in the category of its first
+ * block along with its latency, from the request to its completion. Counters
+ * start from zero when a disk is opened, and remain available after it is
+ * closed.
+ *
+ * Return: -1 if @stats is NULL. 0 otherwise.
+ */
+int block_stats_snapshot(struct block_stats *stats);
+
+/**
+ * block_stats_reset - Clear the I/O statistics
+ */
+void block_stats_reset(void);
+
 #endif /* _DISK_H */
 
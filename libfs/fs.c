@@ -5,33 +5,93 @@
 #include <string.h>
 #include <stdbool.h>
 
+#include "cache.h"
 #include "disk.h"
 #include "fs.h"
 #include "mylibrary.h"
 
-int fs_mount(const char *diskname)
+/* mount @diskname on the instance of the calling thread, a new ram disk of @data_blk_cnt blocks if NULL */
+static int fs_mount_on(const char *diskname, size_t data_blk_cnt)
 {
-
-	if (block_disk_open(diskname) != 0)
+	if (diskname != NULL ? block_disk_open(diskname) != 0 : !fs_format_ram_disk(data_blk_cnt))
 	{
 		return -1;
 	}
 
 	if (!fs_mount_init(diskname)) /* init super,fat, root directory blocks */
 	{
+		block_disk_close(); /* leave the disk free for another attempt */
 		return -1;
 	}
 
 	return 0;
 }
 
-int fs_umount(void)
+int fs_mount(const char *diskname)
+{
+	fs_use(fs_default_context());
+
+	if (diskname == NULL)
+	{
+		return -1;
+	}
+
+	return fs_mount_on(diskname, 0);
+}
+
+int fs_mount_ram(size_t data_blk_cnt)
+{
+	fs_use(fs_default_context());
+
+	return fs_mount_on(NULL, data_blk_cnt);
+}
+
+/* mount on a new instance, see fs_mount_on() */
+static struct fs_context *fs_mount_new_ctx(const char *diskname, size_t data_blk_cnt)
+{
+	struct fs_context *ctx = fs_context_new();
+
+	if (ctx == NULL)
+	{
+		return NULL;
+	}
+
+	fs_use(ctx);
+
+	if (fs_mount_on(diskname, data_blk_cnt) != 0)
+	{
+		fs_context_free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+struct fs_context *fs_mount_ctx(const char *diskname)
+{
+	return diskname != NULL ? fs_mount_new_ctx(diskname, 0) : NULL;
+}
+
+struct fs_context *fs_mount_ram_ctx(size_t data_blk_cnt)
+{
+	return fs_mount_new_ctx(NULL, data_blk_cnt);
+}
+
+/* unmount the instance of the calling thread */
+static int fs_umount_current(void)
 {
 	if (!fs_is_mounted())
 	{
 		return -1; /* no underlying virtual disk was opened */
 	}
 
+	aio_pool_stop(); /* let the requests in flight finish first */
+
+	if (cache_flush() < 0)
+	{
+		return -1; /* keep the file system mounted rather than lose data */
+	}
+
 	if (block_disk_close() != 0)
 	{
 		return -1;
@@ -42,51 +102,101 @@ int fs_umount(void)
 	return 0;
 }
 
+int fs_umount(void)
+{
+	fs_use(fs_default_context());
+
+	return fs_umount_current();
+}
+
+int fs_umount_ctx(struct fs_context *ctx)
+{
+	if (!fs_use(ctx))
+	{
+		return -1;
+	}
+
+	if (fs_umount_current() != 0)
+	{
+		return -1;
+	}
+
+	fs_context_free(ctx);
+
+	return 0;
+}
+
 int fs_info(void)
 {
+	return fs_info_ctx(fs_default_context());
+}
+
+int fs_info_ctx(struct fs_context *ctx)
+{
+	if (!fs_use(ctx))
+	{
+		return -1; /* not an instance */
+	}
+
 	if (!fs_is_mounted())
 	{
 		return -1; /* no underlying virtual disk was opened */
 	}
 
+	fs_lock_dir();
+	fs_lock_alloc(); /* for the free fat entry count */
 	fs_print_info();
+	fs_unlock_alloc();
+	fs_unlock_dir();
 
 	return 0;
 }
 
 int fs_create(const char *filename)
 {
-	if (!fs_is_mounted())
-	{
-		return -1; /* no underlying virtual disk was opened */
-	}
+	return fs_create_ctx(fs_default_context(), filename);
+}
 
-	/* check if root block is full */
-	if (root_block_is_full())
+int fs_create_ctx(struct fs_context *ctx, const char *filename)
+{
+	if (!fs_use(ctx))
 	{
-		return -1;
+		return -1; /* not an instance */
 	}
 
-	/* check if filename is NULL terminated and has valid length */
-	if (!is_filename_valid(filename))
+	if (!fs_is_mounted())
 	{
-		return -1;
+		return -1; /* no underlying virtual disk was opened */
 	}
 
-	/* check if filename already exists */
-	if (filename_already_exists_in_root(filename))
+	fs_lock_dir();
+
+	/* check if root block is full, if filename is NULL terminated and has valid length, and if it already exists */
+	bool can_create = !root_block_is_full() && is_filename_valid(filename) && !filename_already_exists_in_root(filename);
+
+	if (can_create)
 	{
-		return -1;
+		/* add the new file to system and disk */
+		create_new_file_on_root(filename);
 	}
 
-	/* add the new file to system and disk */
-	create_new_file_on_root(filename);
+	fs_unlock_dir();
 
-	return 0;
+	return can_create ? 0 : -1;
 }
 
 int fs_delete(const char *filename)
 {
+	return fs_delete_ctx(fs_default_context(), filename);
+}
+
+int fs_delete_ctx(struct fs_context *ctx, const char *filename)
+{
+	if (!fs_use(ctx))
+	{
+		return -1; /* not an instance */
+	}
+
 	if (!fs_is_mounted())
 	{
 		return -1; /* no underlying virtual disk was opened */
@@ -98,61 +208,89 @@ int fs_delete(const char *filename)
 		return -1;
 	}
 
-	/* check if filename exists */
-	if (!filename_already_exists_in_root(filename))
-	{
-		return -1;
-	}
+	fs_lock_dir();
 
-	/* check if filename is currently open */
-	if (file_is_open(filename))
+	/* check if filename exists and is not currently open */
+	bool can_delete = filename_already_exists_in_root(filename) && !file_is_open(filename);
+
+	if (can_delete)
 	{
-		return -1;
+		delete_file(filename);
 	}
 
-	delete_file(filename);
+	fs_unlock_dir();
 
-	return 0;
+	return can_delete ? 0 : -1;
 }
 
 int fs_ls(void)
 {
+	return fs_ls_ctx(fs_default_context());
+}
+
+int fs_ls_ctx(struct fs_context *ctx)
+{
+	if (!fs_use(ctx))
+	{
+		return -1; /* not an instance */
+	}
+
 	if (!fs_is_mounted())
 	{
 		return -1; /* no underlying virtual disk was opened */
 	}
 
+	fs_lock_dir();
 	fs_print_ls();
+	fs_unlock_dir();
 
 	return 0;
 }
 
 int fs_open(const char *filename)
 {
+	return fs_open_ctx(fs_default_context(), filename);
+}
+
+int fs_open_ctx(struct fs_context *ctx, const char *filename)
+{
+	if (!fs_use(ctx))
+	{
+		return -1; /* not an instance */
+	}
+
 	if (!fs_is_mounted())
 	{
 		return -1; /* no underlying virtual disk was opened */
 	}
 
-	/* check if filename is valid and exists */
-	if (!is_filename_valid(filename) || !filename_already_exists_in_root(filename))
+	if (!is_filename_valid(filename))
 	{
 		return -1;
 	}
 
-	int new_fd = get_new_fd(filename);
+	fs_lock_dir();
 
-	/* check if there are already %FS_OPEN_MAX_COUNT files currently open */
-	if (new_fd < 0)
-	{
-		return -1; /* cannot open the file because no availble fd exists */
-	}
+	/* -1 if the file does not exist, or if there are already %FS_OPEN_MAX_COUNT files currently open */
+	int new_fd = filename_already_exists_in_root(filename) ? get_new_fd(filename) : -1;
+
+	fs_unlock_dir();
 
 	return new_fd;
 }
 
 int fs_close(int fd)
 {
+	return fs_close_ctx(fs_default_context(), fd);
+}
+
+int fs_close_ctx(struct fs_context *ctx, int fd)
+{
+	if (!fs_use(ctx))
+	{
+		return -1; /* not an instance */
+	}
+
 	if (!fs_is_mounted())
 	{
 		return -1; /* no underlying virtual disk was opened */
@@ -163,13 +301,25 @@ int fs_close(int fd)
 		return -1;
 	}
 
+	fs_lock_dir();
 	close_fd(fd);
+	fs_unlock_dir();
 
 	return 0;
 }
 
 int fs_stat(int fd)
 {
+	return fs_stat_ctx(fs_default_context(), fd);
+}
+
+int fs_stat_ctx(struct fs_context *ctx, int fd)
+{
+	if (!fs_use(ctx))
+	{
+		return -1; /* not an instance */
+	}
+
 	if (!fs_is_mounted())
 	{
 		return -1; /* no underlying virtual disk was opened */
@@ -180,11 +330,54 @@ int fs_stat(int fd)
 		return -1;
 	}
 
-	return find_file_size(fd);
+	file_lock(fd, false);
+	int size = find_file_size(fd);
+	file_unlock(fd);
+
+	return size;
+}
+
+int fs_extent_count(int fd)
+{
+	return fs_extent_count_ctx(fs_default_context(), fd);
+}
+
+int fs_extent_count_ctx(struct fs_context *ctx, int fd)
+{
+	if (!fs_use(ctx))
+	{
+		return -1; /* not an instance */
+	}
+
+	if (!fs_is_mounted())
+	{
+		return -1; /* no underlying virtual disk was opened */
+	}
+
+	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || !fd_is_in_use(fd))
+	{
+		return -1;
+	}
+
+	file_lock(fd, false);
+	int cnt = find_extent_cnt(fd);
+	file_unlock(fd);
+
+	return cnt;
 }
 
 int fs_lseek(int fd, size_t offset)
 {
+	return fs_lseek_ctx(fs_default_context(), fd, offset);
+}
+
+int fs_lseek_ctx(struct fs_context *ctx, int fd, size_t offset)
+{
+	if (!fs_use(ctx))
+	{
+		return -1; /* not an instance */
+	}
+
 	if (!fs_is_mounted())
 	{
 		return -1; /* no underlying virtual disk was opened */
@@ -195,19 +388,45 @@ int fs_lseek(int fd, size_t offset)
 		return -1;
 	}
 
+	file_lock(fd, false);
+
 	/* check if offset is larger than the current file size */
-	if (offset > find_file_size(fd))
+	bool in_file = offset <= find_file_size(fd);
+
+	if (in_file)
 	{
-		return -1;
+		change_fd_offset(fd, offset);
 	}
 
-	change_fd_offset(fd, offset);
+	file_unlock(fd);
 
-	return 0;
+	return in_file ? 0 : -1;
 }
 
 int fs_write(int fd, void *buf, size_t count)
 {
+	return fs_write_ctx(fs_default_context(), fd, buf, count);
+}
+
+int fs_write_ctx(struct fs_context *ctx, int fd, void *buf, size_t count)
+{
+	struct iovec iov = {.iov_base = buf, .iov_len = count};
+
+	return fs_writev_ctx(ctx, fd, &iov, 1);
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	return fs_writev_ctx(fs_default_context(), fd, iov, iovcnt);
+}
+
+int fs_writev_ctx(struct fs_context *ctx, int fd, const struct iovec *iov, int iovcnt)
+{
+	if (!fs_use(ctx))
+	{
+		return -1; /* not an instance */
+	}
+
 	if (!fs_is_mounted())
 	{
 		return -1; /* no underlying virtual disk was opened */
@@ -218,11 +437,110 @@ int fs_write(int fd, void *buf, size_t count)
 		return -1;
 	}
 
-	return fs_write_impl(fd, buf, count);
+	if (iovcnt < 0 || (iov == NULL && iovcnt > 0))
+	{
+		return -1;
+	}
+
+	file_lock(fd, true); /* writers of other files only meet on the allocator and the root directory */
+	int bytes_written = fs_write_impl(fd, iov, iovcnt, get_fd_offset(fd), true);
+	file_unlock(fd);
+
+	return bytes_written;
 }
 
 int fs_read(int fd, void *buf, size_t count)
 {
+	return fs_read_ctx(fs_default_context(), fd, buf, count);
+}
+
+int fs_read_ctx(struct fs_context *ctx, int fd, void *buf, size_t count)
+{
+	struct iovec iov = {.iov_base = buf, .iov_len = count};
+
+	return fs_readv_ctx(ctx, fd, &iov, 1);
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	return fs_readv_ctx(fs_default_context(), fd, iov, iovcnt);
+}
+
+int fs_readv_ctx(struct fs_context *ctx, int fd, const struct iovec *iov, int iovcnt)
+{
+	if (!fs_use(ctx))
+	{
+		return -1; /* not an instance */
+	}
+
+	if (!fs_is_mounted())
+	{
+		return -1; /* no underlying virtual disk was opened */
+	}
+
+	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || !fd_is_in_use(fd))
+	{
+		return -1;
+	}
+
+	if (iovcnt < 0 || (iov == NULL && iovcnt > 0))
+	{
+		return -1;
+	}
+
+	file_lock(fd, false); /* readers of the file run in parallel */
+	int bytes_read = fs_read_impl(fd, iov, iovcnt, get_fd_offset(fd), true);
+	file_unlock(fd);
+
+	return bytes_read;
+}
+
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset)
+{
+	return fs_pwrite_ctx(fs_default_context(), fd, buf, count, offset);
+}
+
+int fs_pwrite_ctx(struct fs_context *ctx, int fd, void *buf, size_t count, size_t offset)
+{
+	if (!fs_use(ctx))
+	{
+		return -1; /* not an instance */
+	}
+
+	if (!fs_is_mounted())
+	{
+		return -1; /* no underlying virtual disk was opened */
+	}
+
+	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT || !fd_is_in_use(fd))
+	{
+		return -1;
+	}
+
+	struct iovec iov = {.iov_base = buf, .iov_len = count};
+
+	file_lock(fd, true);
+
+	/* same bound as fs_lseek(), the file cannot have holes */
+	int bytes_written = offset <= find_file_size(fd) ? fs_write_impl(fd, &iov, 1, offset, false) : -1;
+
+	file_unlock(fd);
+
+	return bytes_written;
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	return fs_pread_ctx(fs_default_context(), fd, buf, count, offset);
+}
+
+int fs_pread_ctx(struct fs_context *ctx, int fd, void *buf, size_t count, size_t offset)
+{
+	if (!fs_use(ctx))
+	{
+		return -1; /* not an instance */
+	}
+
 	if (!fs_is_mounted())
 	{
 		return -1; /* no underlying virtual disk was opened */
@@ -233,5 +551,121 @@ int fs_read(int fd, void *buf, size_t count)
 		return -1;
 	}
 
-	return fs_read_impl(fd, buf, count);
+	struct iovec iov = {.iov_base = buf, .iov_len = count};
+
+	file_lock(fd, false);
+	int bytes_read = offset <= find_file_size(fd) ? fs_read_impl(fd, &iov, 1, offset, false) : -1;
+	file_unlock(fd);
+
+	return bytes_read;
+}
+
+int fs_sync(void)
+{
+	return fs_sync_ctx(fs_default_context());
+}
+
+int fs_sync_ctx(struct fs_context *ctx)
+{
+	if (!fs_use(ctx))
+	{
+		return -1; /* not an instance */
+	}
+
+	if (!fs_is_mounted())
+	{
+		return -1; /* no underlying virtual disk was opened */
+	}
+
+	if (cache_flush() < 0)
+	{
+		return -1;
+	}
+
+	return block_disk_sync();
+}
+
+int fs_cache_stats(struct fs_cache_stats *stats)
+{
+	return fs_cache_stats_ctx(fs_default_context(), stats);
+}
+
+int fs_cache_stats_ctx(struct fs_context *ctx, struct fs_cache_stats *stats)
+{
+	if (!fs_use(ctx))
+	{
+		return -1; /* not an instance */
+	}
+
+	if (!fs_is_mounted() || stats == NULL)
+	{
+		return -1;
+	}
+
+	cache_get_stats(stats);
+
+	return 0;
+}
+
+/* queue @req on the instance @ctx */
+static int fs_aio_submit(struct fs_context *ctx, struct fs_aio *req, int write)
+{
+	if (!fs_use(ctx))
+	{
+		return -1; /* not an instance */
+	}
+
+	if (!fs_is_mounted() || req == NULL)
+	{
+		return -1;
+	}
+
+	if (req->fd < 0 || req->fd >= FS_OPEN_MAX_COUNT || !fd_is_in_use(req->fd))
+	{
+		return -1;
+	}
+
+	req->write = write;
+
+	return aio_pool_submit(req) ? 0 : -1;
+}
+
+int fs_aio_read(struct fs_aio *req)
+{
+	return fs_aio_read_ctx(fs_default_context(), req);
+}
+
+int fs_aio_read_ctx(struct fs_context *ctx, struct fs_aio *req)
+{
+	return fs_aio_submit(ctx, req, 0);
+}
+
+int fs_aio_write(struct fs_aio *req)
+{
+	return fs_aio_write_ctx(fs_default_context(), req);
+}
+
+int fs_aio_write_ctx(struct fs_context *ctx, struct fs_aio *req)
+{
+	return fs_aio_submit(ctx, req, 1);
+}
+
+int fs_aio_poll(struct fs_aio **reqs, int max, int wait)
+{
+	return fs_aio_poll_ctx(fs_default_context(), reqs, max, wait);
+}
+
+int fs_aio_poll_ctx(struct fs_context *ctx, struct fs_aio **reqs, int max, int wait)
+{
+	if (!fs_use(ctx))
+	{
+		return -1; /* not an instance */
+	}
+
+	if (!fs_is_mounted() || reqs == NULL || max < 0)
+	{
+		return -1;
+	}
+
+	return aio_pool_poll(reqs, max, wait);
 }
@@ -1,7 +1,8 @@
 #ifndef _FS_H
 #define _FS_H
 
-#include <stddef.h> /* for size_t definition */
+#include <stddef.h>  /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -12,6 +13,44 @@
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Counters of the buffer cache, see fs_cache_stats() */
+struct fs_cache_stats {
+	/* Number of block buffers, 0 if the cache is disabled */
+	size_t capacity;
+	/* Block accesses served from a buffer */
+	size_t hits;
+	/* Block accesses that had to go to the disk */
+	size_t misses;
+	/* Buffers recycled to hold another block */
+	size_t evictions;
+	/* Dirty buffers written back to the disk */
+	size_t writebacks;
+	/* Blocks read ahead of sequential readers */
+	size_t prefetches;
+};
+
+/** Asynchronous read or write of a file, see fs_aio_read() */
+struct fs_aio {
+	/* File descriptor */
+	int fd;
+	/* Data buffer, filled by a read or written in the file by a write */
+	void *buf;
+	/* Number of bytes of data to be read or written */
+	size_t count;
+	/* File offset to read from or write at, as for fs_pread() and fs_pwrite() */
+	size_t offset;
+	/* Called once done, or NULL to have the request returned by fs_aio_poll() */
+	void (*callback)(struct fs_aio *req);
+	/* Left to the caller, e.g. to find its own state back in @callback */
+	void *data;
+	/* Once done, what fs_pread() or fs_pwrite() would have returned */
+	int result;
+	/* Used by the file system while the request is in flight */
+	int write;
+	struct fs_context *ctx;
+	struct fs_aio *next;
+};
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -25,6 +64,20 @@
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_ram - Mount a new file system held in memory
+ * @data_blk_cnt: Number of data blocks of the file system
+ *
+ * Like fs_mount(), on a virtual disk that is created empty in memory instead of
+ * being read from a file, with room for @data_blk_cnt data blocks. Nothing on
+ * the host filesystem is touched, and everything is lost when the file system
+ * is unmounted.
+ *
+ * Return: -1 if @data_blk_cnt is 0 or too large for the 16-bit block indices of
+ * the file system, or if the disk cannot be allocated. 0 otherwise.
+ */
+int fs_mount_ram(size_t data_blk_cnt);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -121,6 +174,18 @@ int fs_close(int fd);
  */
 int fs_stat(int fd);
 
+/**
+ * fs_extent_count - Get the fragmentation of a file
+ * @fd: File descriptor
+ *
+ * Count the runs of contiguous data blocks the file pointed by file descriptor
+ * @fd is made of. A file written on a clean disk is one extent.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of extents of the file, 0 if it is empty.
+ */
+int fs_extent_count(int fd);
+
 /**
  * fs_lseek - Set file offset
  * @fd: File descriptor
@@ -172,9 +237,467 @@ int fs_write(int fd, void *buf, size_t count);
  * is at the end of the file). The file offset of the file descriptor is
  * implicitly incremented by the number of bytes that were actually read.
  *
+ * A mounted file system can be used from several threads at once, as long as
+ * each file descriptor is used by one thread at a time. Reads proceed in
+ * parallel, including reads of the same file through different descriptors. A
+ * write excludes other reads and writes of the same file only; writes to
+ * different files only serialize while allocating blocks and updating the root
+ * directory. fs_mount() and fs_umount() must not run concurrently with any
+ * other call.
+ *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
  * open). Otherwise return the number of bytes actually read.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to write in the file, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Like fs_write() with the concatenation of the @iovcnt buffers of @iov, but
+ * done as a single write: blocks are allocated once for the total length and
+ * the file size is updated once.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @iovcnt is negative. Otherwise return the number of bytes
+ * actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to be filled with data, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Like fs_read() into the concatenation of the @iovcnt buffers of @iov, done
+ * as a single read.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @iovcnt is negative. Otherwise return the number of bytes
+ * actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Like fs_write(), but start writing at @offset instead of the file offset of
+ * @fd, which is left unchanged.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @offset is larger than the current file size. Otherwise return
+ * the number of bytes actually written.
+ */
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Like fs_read(), but start reading at @offset instead of the file offset of
+ * @fd, which is left unchanged. Unlike fs_read(), the same file descriptor can
+ * be used by several threads at once, and random reads need no fs_lseek().
+ * No read ahead is started on behalf of positional reads.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @offset is larger than the current file size. Otherwise return
+ * the number of bytes actually read.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_sync - Flush file system
+ *
+ * Data blocks are kept in a write-back buffer cache between the file system and
+ * the virtual disk. Write back every dirty block and flush the virtual disk
+ * file. This also happens when the file system is unmounted.
+ *
+ * The cache holds 256 blocks by default. The environment variable
+ * LIBFS_CACHE_BLOCKS, read at mount time, changes that number, and 0 disables
+ * the cache. Blocks following a sequential reader's position are read ahead
+ * into the cache in the background.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if the blocks cannot
+ * be written back. 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_cache_stats - Get buffer cache statistics
+ * @stats: Filled with the counters since the file system was mounted
+ *
+ * The hit rate of the cache is @stats->hits / (@stats->hits + @stats->misses).
+ *
+ * Return: -1 if no underlying virtual disk was opened or if @stats is NULL. 0
+ * otherwise.
+ */
+int fs_cache_stats(struct fs_cache_stats *stats);
+
+/**
+ * fs_aio_read - Start reading from a file
+ * @req: Request, with @req->fd, @req->buf, @req->count, @req->offset,
+ *       @req->callback and @req->data set by the caller
+ *
+ * Queue fs_pread(@req->fd, @req->buf, @req->count, @req->offset) and return
+ * right away. The read is run by a pool of worker threads started on the first
+ * request, so that many requests have their block I/O in flight at once. The
+ * environment variable LIBFS_AIO_WORKERS, read at that time, sets the number of
+ * workers, 8 by default.
+ *
+ * Once done, @req->result is set and @req->callback is called from a worker
+ * thread, or if it is NULL, @req is queued for fs_aio_poll(). The callback can
+ * start other requests but must not unmount the file system.
+ *
+ * @req, @req->buf and file descriptor @req->fd must stay valid until then.
+ * Requests in flight at the same time are run in no particular order, even on
+ * the same file descriptor. fs_umount() waits for every request in flight.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @req is NULL, or if
+ * file descriptor @req->fd is invalid (out of bounds or not currently open). 0
+ * otherwise.
+ */
+int fs_aio_read(struct fs_aio *req);
+
+/**
+ * fs_aio_write - Start writing to a file
+ * @req: Request, set up as for fs_aio_read()
+ *
+ * Like fs_aio_read(), but queue fs_pwrite(@req->fd, @req->buf, @req->count,
+ * @req->offset).
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @req is NULL, or if
+ * file descriptor @req->fd is invalid (out of bounds or not currently open). 0
+ * otherwise.
+ */
+int fs_aio_write(struct fs_aio *req);
+
+/**
+ * fs_aio_poll - Collect finished requests
+ * @reqs: Filled with the finished requests, oldest first
+ * @max: Size of @reqs
+ * @wait: If not 0, wait for a request to finish when none has yet
+ *
+ * Only requests started without a callback are returned, each of them once.
+ * Waiting returns right away when no such request is in flight.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @reqs is NULL, or if
+ * @max is negative. Otherwise return the number of requests stored in @reqs.
+ */
+int fs_aio_poll(struct fs_aio **reqs, int max, int wait);
+
+/** Mounted file system instance, see fs_mount_ctx() */
+struct fs_context;
+
+/**
+ * fs_mount_ctx - Mount a file system as a separate instance
+ * @diskname: Name of the virtual disk file
+ *
+ * Like fs_mount(), but the file system gets an instance of its own, with its
+ * own virtual disk, buffer cache and file descriptors. Any number of instances
+ * can be mounted next to each other and next to the one used by the functions
+ * without a context, which is the default instance.
+ *
+ * An instance is accessed with the _ctx variant of each function, which take
+ * it as first argument and otherwise behave as the function of the same name.
+ * It stays valid until fs_umount_ctx() succeeds on it. File descriptors belong
+ * to the instance that opened them and mean nothing to another one.
+ *
+ * Each instance can be used by several threads as described for fs_read(), and
+ * calls on different instances never wait for each other. fs_umount_ctx() must
+ * not run concurrently with any other call on the same instance.
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. The new instance otherwise.
+ */
+struct fs_context *fs_mount_ctx(const char *diskname);
+
+/**
+ * fs_mount_ram_ctx - Mount a new file system held in memory as an instance
+ * @data_blk_cnt: Number of data blocks of the file system
+ *
+ * Like fs_mount_ram(), on an instance of its own as for fs_mount_ctx().
+ *
+ * Return: NULL in the cases listed for fs_mount_ram(). The new instance
+ * otherwise.
+ */
+struct fs_context *fs_mount_ram_ctx(size_t data_blk_cnt);
+
+/**
+ * fs_umount_ctx - Unmount a file system instance
+ * @ctx: Instance returned by fs_mount_ctx()
+ *
+ * Like fs_umount(). Once unmounted, @ctx is freed and must not be used anymore.
+ *
+ * Return: -1 if @ctx is not mounted or cannot be unmounted, in which case it is
+ * left mounted. 0 otherwise.
+ */
+int fs_umount_ctx(struct fs_context *ctx);
+
+/**
+ * fs_info_ctx - Display information about a file system instance
+ * @ctx: Instance returned by fs_mount_ctx()
+ *
+ * Like fs_info().
+ *
+ * Return: -1 if @ctx is not mounted. 0 otherwise.
+ */
+int fs_info_ctx(struct fs_context *ctx);
+
+/**
+ * fs_create_ctx - Create a new file on a file system instance
+ * @ctx: Instance returned by fs_mount_ctx()
+ * @filename: File name
+ *
+ * Like fs_create().
+ *
+ * Return: -1 if @ctx is not mounted, or in the cases listed for fs_create(). 0
+ * otherwise.
+ */
+int fs_create_ctx(struct fs_context *ctx, const char *filename);
+
+/**
+ * fs_delete_ctx - Delete a file from a file system instance
+ * @ctx: Instance returned by fs_mount_ctx()
+ * @filename: File name
+ *
+ * Like fs_delete().
+ *
+ * Return: -1 if @ctx is not mounted, or in the cases listed for fs_delete(). 0
+ * otherwise.
+ */
+int fs_delete_ctx(struct fs_context *ctx, const char *filename);
+
+/**
+ * fs_ls_ctx - List files on a file system instance
+ * @ctx: Instance returned by fs_mount_ctx()
+ *
+ * Like fs_ls().
+ *
+ * Return: -1 if @ctx is not mounted. 0 otherwise.
+ */
+int fs_ls_ctx(struct fs_context *ctx);
+
+/**
+ * fs_open_ctx - Open a file of a file system instance
+ * @ctx: Instance returned by fs_mount_ctx()
+ * @filename: File name
+ *
+ * Like fs_open(). The file descriptor can only be used with the _ctx functions
+ * on @ctx, and each instance has %FS_OPEN_MAX_COUNT descriptors of its own.
+ *
+ * Return: -1 if @ctx is not mounted, or in the cases listed for fs_open().
+ * Otherwise, return the file descriptor.
+ */
+int fs_open_ctx(struct fs_context *ctx, const char *filename);
+
+/**
+ * fs_close_ctx - Close a file of a file system instance
+ * @ctx: Instance returned by fs_mount_ctx()
+ * @fd: File descriptor of @ctx
+ *
+ * Like fs_close().
+ *
+ * Return: -1 if @ctx is not mounted, or if file descriptor @fd is invalid (out
+ * of bounds or not currently open on @ctx). 0 otherwise.
+ */
+int fs_close_ctx(struct fs_context *ctx, int fd);
+
+/**
+ * fs_stat_ctx - Get the status of a file of a file system instance
+ * @ctx: Instance returned by fs_mount_ctx()
+ * @fd: File descriptor of @ctx
+ *
+ * Like fs_stat().
+ *
+ * Return: -1 if @ctx is not mounted, or if file descriptor @fd is invalid (out
+ * of bounds or not currently open on @ctx). Otherwise return the current size
+ * of file.
+ */
+int fs_stat_ctx(struct fs_context *ctx, int fd);
+
+/**
+ * fs_extent_count_ctx - Get the fragmentation of a file of a file system instance
+ * @ctx: Instance returned by fs_mount_ctx()
+ * @fd: File descriptor of @ctx
+ *
+ * Like fs_extent_count().
+ *
+ * Return: -1 if @ctx is not mounted, or if file descriptor @fd is invalid (out
+ * of bounds or not currently open on @ctx). Otherwise return the number of
+ * extents of the file.
+ */
+int fs_extent_count_ctx(struct fs_context *ctx, int fd);
+
+/**
+ * fs_lseek_ctx - Set the offset of a file of a file system instance
+ * @ctx: Instance returned by fs_mount_ctx()
+ * @fd: File descriptor of @ctx
+ * @offset: File offset
+ *
+ * Like fs_lseek().
+ *
+ * Return: -1 if @ctx is not mounted, or in the cases listed for fs_lseek(). 0
+ * otherwise.
+ */
+int fs_lseek_ctx(struct fs_context *ctx, int fd, size_t offset);
+
+/**
+ * fs_write_ctx - Write to a file of a file system instance
+ * @ctx: Instance returned by fs_mount_ctx()
+ * @fd: File descriptor of @ctx
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ *
+ * Like fs_write().
+ *
+ * Return: -1 if @ctx is not mounted, or if file descriptor @fd is invalid (out
+ * of bounds or not currently open on @ctx). Otherwise return the number of
+ * bytes actually written.
+ */
+int fs_write_ctx(struct fs_context *ctx, int fd, void *buf, size_t count);
+
+/**
+ * fs_read_ctx - Read from a file of a file system instance
+ * @ctx: Instance returned by fs_mount_ctx()
+ * @fd: File descriptor of @ctx
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ *
+ * Like fs_read(), with the same rules for the threads sharing @ctx.
+ *
+ * Return: -1 if @ctx is not mounted, or if file descriptor @fd is invalid (out
+ * of bounds or not currently open on @ctx). Otherwise return the number of
+ * bytes actually read.
+ */
+int fs_read_ctx(struct fs_context *ctx, int fd, void *buf, size_t count);
+
+/**
+ * fs_writev_ctx - Write to a file of an instance from several buffers
+ * @ctx: Instance returned by fs_mount_ctx()
+ * @fd: File descriptor of @ctx
+ * @iov: Buffers to write in the file, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Like fs_writev().
+ *
+ * Return: -1 if @ctx is not mounted, or in the cases listed for fs_writev().
+ * Otherwise return the number of bytes actually written.
+ */
+int fs_writev_ctx(struct fs_context *ctx, int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv_ctx - Read from a file of an instance into several buffers
+ * @ctx: Instance returned by fs_mount_ctx()
+ * @fd: File descriptor of @ctx
+ * @iov: Buffers to be filled with data, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Like fs_readv().
+ *
+ * Return: -1 if @ctx is not mounted, or in the cases listed for fs_readv().
+ * Otherwise return the number of bytes actually read.
+ */
+int fs_readv_ctx(struct fs_context *ctx, int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_pwrite_ctx - Write to a file of a file system instance at a given offset
+ * @ctx: Instance returned by fs_mount_ctx()
+ * @fd: File descriptor of @ctx
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Like fs_pwrite().
+ *
+ * Return: -1 if @ctx is not mounted, or in the cases listed for fs_pwrite().
+ * Otherwise return the number of bytes actually written.
+ */
+int fs_pwrite_ctx(struct fs_context *ctx, int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread_ctx - Read from a file of a file system instance at a given offset
+ * @ctx: Instance returned by fs_mount_ctx()
+ * @fd: File descriptor of @ctx
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Like fs_pread(), so @fd can be used by several threads at once.
+ *
+ * Return: -1 if @ctx is not mounted, or in the cases listed for fs_pread().
+ * Otherwise return the number of bytes actually read.
+ */
+int fs_pread_ctx(struct fs_context *ctx, int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_sync_ctx - Flush a file system instance
+ * @ctx: Instance returned by fs_mount_ctx()
+ *
+ * Like fs_sync(), for the buffer cache and virtual disk of @ctx only.
+ *
+ * Return: -1 if @ctx is not mounted, or if the blocks cannot be written back. 0
+ * otherwise.
+ */
+int fs_sync_ctx(struct fs_context *ctx);
+
+/**
+ * fs_cache_stats_ctx - Get buffer cache statistics of a file system instance
+ * @ctx: Instance returned by fs_mount_ctx()
+ * @stats: Filled with the counters of @ctx since it was mounted
+ *
+ * Like fs_cache_stats(). Each instance has a buffer cache of its own.
+ *
+ * Return: -1 if @ctx is not mounted or if @stats is NULL. 0 otherwise.
+ */
+int fs_cache_stats_ctx(struct fs_context *ctx, struct fs_cache_stats *stats);
+
+/**
+ * fs_aio_read_ctx - Start reading from a file of a file system instance
+ * @ctx: Instance returned by fs_mount_ctx()
+ * @req: Request, with @req->fd a file descriptor of @ctx
+ *
+ * Like fs_aio_read(). The request is run by the worker pool of @ctx and can
+ * only be returned by fs_aio_poll_ctx() on @ctx. fs_umount_ctx() waits for it.
+ *
+ * Return: -1 if @ctx is not mounted, or in the cases listed for fs_aio_read().
+ * 0 otherwise.
+ */
+int fs_aio_read_ctx(struct fs_context *ctx, struct fs_aio *req);
+
+/**
+ * fs_aio_write_ctx - Start writing to a file of a file system instance
+ * @ctx: Instance returned by fs_mount_ctx()
+ * @req: Request, with @req->fd a file descriptor of @ctx
+ *
+ * Like fs_aio_write(), run and completed as described for fs_aio_read_ctx().
+ *
+ * Return: -1 if @ctx is not mounted, or in the cases listed for fs_aio_write().
+ * 0 otherwise.
+ */
+int fs_aio_write_ctx(struct fs_context *ctx, struct fs_aio *req);
+
+/**
+ * fs_aio_poll_ctx - Collect finished requests of a file system instance
+ * @ctx: Instance returned by fs_mount_ctx()
+ * @reqs: Filled with the finished requests, oldest first
+ * @max: Size of @reqs
+ * @wait: If not 0, wait for a request to finish when none has yet
+ *
+ * Like fs_aio_poll(), for the requests started on @ctx only.
+ *
+ * Return: -1 if @ctx is not mounted, or in the cases listed for fs_aio_poll().
+ * Otherwise return the number of requests stored in @reqs.
+ */
+int fs_aio_poll_ctx(struct fs_context *ctx, struct fs_aio **reqs, int max, int wait);
+
 #endif /* _FS_H */
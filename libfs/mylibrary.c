@@ -1,4 +1,5 @@
 #include "mylibrary.h"
+#include "cache.h"
 #include "disk.h"
 
 #include <stdio.h>
@@ -7,13 +8,12 @@
 #include <string.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <pthread.h>
 #include "mylibrary.h"
 
 /************************* GLOBAL VARS AND CONSTS ********************************/
 uint16_t FAT_EOC = 0xFFFF;
 
-bool _mounted = false;
-
 /************************* ROOT BLOCK ********************************/
 
 typedef struct rootentry
@@ -30,8 +30,8 @@ typedef struct rootdirectory
     rootentry _entrys[FS_FILE_MAX_COUNT];
 } __attribute__((__packed__)) rootdirectory;
 
-rootdirectory _rootdirectory;
-int _free_root_entry_cnt = -1;
+/* hash index from filename to root entry, chained through _root_hash_next */
+#define ROOT_HASH_BUCKET_CNT 256
 
 /************************* SUPER BLOCK ********************************/
 
@@ -46,7 +46,6 @@ typedef struct superblock
     uint8_t _padding[4079];       /* Unused/Padding */
 } __attribute__((__packed__)) superblock;
 
-superblock _superblock;
 const char *_signature = "ECS150FS";
 
 /************************* FAT BLOCK ********************************/
@@ -56,45 +55,166 @@ typedef struct fatblock
     uint16_t _entry[2048];              /* big array of 16 bit entry */
 } __attribute__((__packed__)) fatblock; /* a single fat block*/
 
-fatblock *_fat_section; /* array of fat blocks */
-int _free_FAT_entry_cnt = -1;
-
 int _fat_block_strt_idx = 1;
 int _num_of_fat_entries_per_block = 2048;
 
+#define BEST_FIT_MAX_RUN_CNT 32 /* free runs an allocation looks at before settling for the best so far */
+
+/************************* EXTENT MAP *******************/
+
+typedef struct extent
+{
+    int _logical_blk_idx;  /* first logical block of the file covered by this run */
+    uint16_t _data_blk_idx; /* first data block of the run */
+    uint16_t _len;          /* number of contiguous data blocks in the run */
+} extent;
+
+typedef struct extentmap
+{
+    bool _built; /* false until the chain has been decoded from the FAT, read atomically */
+    int _cnt;
+    int _capacity;
+    extent *_extents; /* sorted by _logical_blk_idx */
+} extentmap;
+
+/************************* OPEN FILE TABLE *******************/
+
+typedef struct openfile
+{
+    int _refcnt;                  /* number of fds bound to this file, 0 if the file is not open */
+    int _root_entry_idx;          /* root entry of the file */
+    uint32_t _file_size_in_bytes; /* cached copy of the size in the root entry */
+    uint16_t _first_data_blk_idx; /* cached copy of the first data block in the root entry */
+    uint16_t _tail_data_blk_idx;  /* last data block of the file, 0 if not looked up yet */
+    extentmap _extent_map;        /* shared by all fds of the file */
+    pthread_rwlock_t _lock;       /* shared by readers, exclusive for a writer */
+    pthread_mutex_t _map_lock;    /* serializes readers decoding the extent map */
+} openfile;
+
 /************************* FILE DESCRIPTOR TABLE *******************/
 
 typedef struct fd
 {
     bool _in_use; /* indicate whether this fd is currently in use */
     size_t _offset;
-    uint8_t _filename[16];
+    openfile *_file; /* open file this fd is bound to */
+    int _cursor_logical_blk_idx;    /* logical block of the file the cursor sits on, -1 if unset */
+    uint16_t _cursor_data_blk_idx;  /* data block backing that logical block */
+    size_t _ra_next_offset;         /* where the next read starts if the fd reads sequentially */
+    int _ra_window;                 /* blocks to keep read ahead of the reader, 0 if not streaming */
+    int _ra_end_logical_blk_idx;    /* first logical block not read ahead yet */
+    uint16_t _ra_last_data_blk_idx; /* data block of the last logical block read ahead */
 } fd;
 
-fd _fd_table[FS_OPEN_MAX_COUNT]; /* fd ranges from 0 to 31 */
+#define READAHEAD_MIN_BLK_CNT 4  /* window of a stream that just started */
+#define READAHEAD_MAX_BLK_CNT 64
+
+/************************* ASYNC FILE I/O *******************/
+
+#define AIOPOOL_DEFAULT_WORKER_CNT 8
+#define AIOPOOL_MAX_WORKER_CNT 64
+
+typedef struct aiopool
+{
+    pthread_mutex_t _lock;
+    pthread_cond_t _submitted; /* a request was queued, or the pool is stopping */
+    pthread_cond_t _completed; /* a request was queued for polling, or the last one in flight finished */
+    pthread_t _workers[AIOPOOL_MAX_WORKER_CNT];
+    int _worker_cnt; /* 0 until the first request */
+    bool _stopping;
+    struct fs_aio *_pending_head; /* submitted and not picked by a worker yet, oldest first */
+    struct fs_aio *_pending_tail;
+    struct fs_aio *_done_head; /* finished without a callback and not polled yet, oldest first */
+    struct fs_aio *_done_tail;
+    int _inflight_cnt; /* submitted and not finished */
+    int _unpolled_cnt; /* submitted without a callback and not polled yet */
+} aiopool;
+
+/************************* FILE SYSTEM INSTANCE *******************/
+
+/* everything a mounted file system keeps in memory, one per fs_context */
+typedef struct fs_context
+{
+    bool _mounted;
+    pthread_mutex_t _dir_lock;   /* root directory, open file and fd tables, taken before _alloc_lock */
+    pthread_mutex_t _alloc_lock; /* fat and free space index */
+    struct block_disk *_disk; /* NULL for the default disk instance */
+    cache _cache;
+    aiopool _aio; /* workers running the fs_aio_* requests */
+
+    rootdirectory _rootdirectory;
+    int _free_root_entry_cnt;
+    int _root_hash_bucket[ROOT_HASH_BUCKET_CNT]; /* first root entry of each bucket, -1 if empty */
+    int _root_hash_next[FS_FILE_MAX_COUNT];      /* next root entry in the same bucket, -1 at the end */
+
+    superblock _superblock;
+
+    fatblock *_fat_section; /* array of fat blocks */
+    int _free_FAT_entry_cnt;
+    bool *_fat_blk_dirty; /* one flag per fat block, set when the in-memory copy differs from disk */
+
+    /* two level bitmap over the data blocks, a set bit means the block is free */
+    uint64_t *_free_blk_bitmap;  /* bit i of the map <=> data block i is free */
+    uint64_t *_free_blk_summary; /* bit w of the summary <=> word w of the map has a free block */
+    int _free_blk_bitmap_word_cnt;
+    int _free_blk_summary_word_cnt;
+    int _next_fit_cursor; /* data block right after the last allocated run */
+
+    openfile _open_files[FS_FILE_MAX_COUNT]; /* indexed by root entry */
+    fd _fd_table[FS_OPEN_MAX_COUNT];         /* fd ranges from 0 to 31 */
+} fs_context;
+
+#define FS_CONTEXT_INIT {._free_root_entry_cnt = -1, ._free_FAT_entry_cnt = -1}
+
+fs_context _default_fs = FS_CONTEXT_INIT; /* instance behind the fs_* calls without a context */
+__thread fs_context *_fs = &_default_fs;  /* instance the calling thread works on, see fs_use() */
+
+/************************* ASYNC I/O BATCH *******************/
+
+#define IOBATCH_MAX_REQS 16
+#define IOBATCH_MAX_IOVS 16 /* buffers of a request: staged head, pieces of the caller's buffers, staged tail */
+
+typedef struct iobatch
+{
+    int _cnt;                                               /* requests submitted and not waited for yet */
+    struct block_aio _reqs[IOBATCH_MAX_REQS];
+    struct iovec _iovs[IOBATCH_MAX_REQS][IOBATCH_MAX_IOVS]; /* buffers of each request */
+} iobatch;
+
+/************************* SCATTER/GATHER LIST *******************/
+
+typedef struct iovcursor
+{
+    const struct iovec *_iov; /* caller's buffers, seen as one byte stream */
+    int _iovcnt;
+    int _idx;         /* buffer holding the last position looked up */
+    size_t _idx_strt; /* position of the first byte of that buffer in the stream */
+} iovcursor;
 
 /************************* FUNCTION IMPLEMENTATION *******************/
 
 void fs_print_info()
 {
     printf("FS Info:\n");
-    printf("total_blk_count=%d\n", _superblock._total_blk_cnt);
-    printf("fat_blk_count=%d\n", _superblock._total_FAT_blk_cnt);
-    printf("rdir_blk=%d\n", _superblock._root_blk_strt_idx);
-    printf("data_blk=%d\n", _superblock._data_blk_strt_idx);
-    printf("data_blk_count=%d\n", _superblock._total_data_blk_cnt);
-    printf("fat_free_ratio=%d/%d\n", _free_FAT_entry_cnt, _superblock._total_data_blk_cnt);
-    printf("rdir_free_ratio=%d/%d\n", _free_root_entry_cnt, FS_FILE_MAX_COUNT);
+    printf("total_blk_count=%d\n", _fs->_superblock._total_blk_cnt);
+    printf("fat_blk_count=%d\n", _fs->_superblock._total_FAT_blk_cnt);
+    printf("rdir_blk=%d\n", _fs->_superblock._root_blk_strt_idx);
+    printf("data_blk=%d\n", _fs->_superblock._data_blk_strt_idx);
+    printf("data_blk_count=%d\n", _fs->_superblock._total_data_blk_cnt);
+    printf("fat_free_ratio=%d/%d\n", _fs->_free_FAT_entry_cnt, _fs->_superblock._total_data_blk_cnt);
+    printf("rdir_free_ratio=%d/%d\n", _fs->_free_root_entry_cnt, FS_FILE_MAX_COUNT);
 }
 
 int get_new_fd(const char *filename)
 {
     for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
     {
-        if (!_fd_table[i]._in_use)
+        if (!_fs->_fd_table[i]._in_use)
         {
-            _fd_table[i]._in_use = true; /* mark this fd as used */
-            memcpy(_fd_table[i]._filename, filename, strlen(filename) + 1);
+            _fs->_fd_table[i]._in_use = true; /* mark this fd as used */
+            _fs->_fd_table[i]._file = open_file_get(find_root_entry_idx(filename));
+            reset_fd_cursor(i);
+            reset_fd_readahead(i);
 
             return i;
         }
@@ -103,32 +223,147 @@ int get_new_fd(const char *filename)
     return -1;
 }
 
-bool file_is_open(const char *filename)
+openfile *open_file_get(int root_entry_idx)
 {
-    for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+    openfile *file = &_fs->_open_files[root_entry_idx];
+
+    if (file->_refcnt == 0)
     {
-        if (_fd_table[i]._in_use && strcmp((const char *)_fd_table[i]._filename, filename) == 0)
-        {
-            return true;
-        }
+        /* first fd on this file, load its metadata from the root entry */
+        file->_root_entry_idx = root_entry_idx;
+        file->_file_size_in_bytes = _fs->_rootdirectory._entrys[root_entry_idx]._file_size_in_bytes;
+        file->_first_data_blk_idx = _fs->_rootdirectory._entrys[root_entry_idx]._first_data_blk_idx;
+        file->_tail_data_blk_idx = file->_file_size_in_bytes == 0 ? FAT_EOC : 0;
+        memset(&file->_extent_map, 0, sizeof(extentmap));
     }
-    return false;
+
+    file->_refcnt++;
+
+    return file;
+}
+
+void open_file_put(openfile *file)
+{
+    file->_refcnt--;
+
+    /* drop the extent map once the last fd of the file is closed */
+    if (file->_refcnt == 0)
+    {
+        extent_map_free(&file->_extent_map);
+    }
+}
+
+bool file_is_open(const char *filename)
+{
+    int i = find_root_entry_idx(filename);
+
+    return i >= 0 && _fs->_open_files[i]._refcnt > 0;
+}
+
+size_t get_fd_offset(int fd)
+{
+    return _fs->_fd_table[fd]._offset;
 }
 
 void change_fd_offset(int fd, size_t offset)
 {
-    _fd_table[fd]._offset = offset;
+    _fs->_fd_table[fd]._offset = offset;
+    reset_fd_cursor(fd);
 }
 
 void close_fd(int fd)
 {
-    _fd_table[fd]._in_use = false;
-    _fd_table[fd]._offset = 0;
+    open_file_put(_fs->_fd_table[fd]._file);
+
+    _fs->_fd_table[fd]._in_use = false;
+    _fs->_fd_table[fd]._offset = 0;
+    _fs->_fd_table[fd]._file = NULL;
+    reset_fd_cursor(fd);
+    reset_fd_readahead(fd);
+}
+
+void reset_fd_cursor(int fd)
+{
+    _fs->_fd_table[fd]._cursor_logical_blk_idx = -1;
+    _fs->_fd_table[fd]._cursor_data_blk_idx = 0;
+}
+
+void set_fd_cursor(int fd, int logical_blk_idx, uint16_t data_blk_idx)
+{
+    _fs->_fd_table[fd]._cursor_logical_blk_idx = logical_blk_idx;
+    _fs->_fd_table[fd]._cursor_data_blk_idx = data_blk_idx;
+}
+
+void reset_fd_readahead(int fd)
+{
+    _fs->_fd_table[fd]._ra_next_offset = 0; /* a first read from the start counts as sequential */
+    _fs->_fd_table[fd]._ra_window = 0;
+    _fs->_fd_table[fd]._ra_end_logical_blk_idx = 0;
+    _fs->_fd_table[fd]._ra_last_data_blk_idx = 0;
+}
+
+void fd_readahead(int fd, bool sequential, int ra_missed_blk_cnt)
+{
+    if (!cache_enabled() || !sequential)
+    {
+        reset_fd_readahead(fd);
+        _fs->_fd_table[fd]._ra_next_offset = _fs->_fd_table[fd]._offset;
+        return;
+    }
+
+    /* grow the window while what was read ahead gets used, shrink it when it was evicted first */
+    int window = _fs->_fd_table[fd]._ra_window;
+    int max_window = READAHEAD_MAX_BLK_CNT < cache_capacity() / 2 ? READAHEAD_MAX_BLK_CNT : cache_capacity() / 2;
+
+    if (window == 0)
+    {
+        window = READAHEAD_MIN_BLK_CNT;
+    }
+    else if (ra_missed_blk_cnt > 0)
+    {
+        window /= 2;
+    }
+    else
+    {
+        window *= 2;
+    }
+
+    window = window < READAHEAD_MIN_BLK_CNT ? READAHEAD_MIN_BLK_CNT : window;
+    window = window > max_window ? max_window : window;
+
+    _fs->_fd_table[fd]._ra_window = window;
+    _fs->_fd_table[fd]._ra_next_offset = _fs->_fd_table[fd]._offset;
+
+    /* prefetch the blocks past the last one read, the chain is walked from where the previous window ended */
+    int logical_blk_idx = _fs->_fd_table[fd]._cursor_logical_blk_idx;
+    uint16_t data_blk_idx = _fs->_fd_table[fd]._cursor_data_blk_idx;
+    int end_logical_blk_idx = logical_blk_idx + 1 + window;
+    int file_blk_cnt = fat_ceil(find_file_size(fd)) / 4096;
+
+    if (end_logical_blk_idx > file_blk_cnt)
+    {
+        end_logical_blk_idx = file_blk_cnt;
+    }
+
+    if (_fs->_fd_table[fd]._ra_end_logical_blk_idx > logical_blk_idx + 1)
+    {
+        logical_blk_idx = _fs->_fd_table[fd]._ra_end_logical_blk_idx - 1; /* already read ahead up to there */
+        data_blk_idx = _fs->_fd_table[fd]._ra_last_data_blk_idx;
+    }
+
+    for (logical_blk_idx++; logical_blk_idx < end_logical_blk_idx; logical_blk_idx++)
+    {
+        data_blk_idx = find_idx_of_next_data_blk(data_blk_idx);
+        cache_prefetch(_fs->_superblock._data_blk_strt_idx + data_blk_idx);
+
+        _fs->_fd_table[fd]._ra_end_logical_blk_idx = logical_blk_idx + 1;
+        _fs->_fd_table[fd]._ra_last_data_blk_idx = data_blk_idx;
+    }
 }
 
 bool fd_is_in_use(int fd)
 {
-    return _fd_table[fd]._in_use;
+    return _fs->_fd_table[fd]._in_use;
 }
 
 void fs_print_ls()
@@ -138,10 +373,10 @@ void fs_print_ls()
     for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
     {
 
-        if (_rootdirectory._entrys[i]._first_data_blk_idx != 0)
+        if (_fs->_rootdirectory._entrys[i]._first_data_blk_idx != 0)
         {
 
-            printf("file: %s, size: %d, data_blk: %d\n", _rootdirectory._entrys[i]._filename, _rootdirectory._entrys[i]._file_size_in_bytes, _rootdirectory._entrys[i]._first_data_blk_idx);
+            printf("file: %s, size: %d, data_blk: %d\n", _fs->_rootdirectory._entrys[i]._filename, _fs->_rootdirectory._entrys[i]._file_size_in_bytes, _fs->_rootdirectory._entrys[i]._first_data_blk_idx);
         }
     }
 }
@@ -170,19 +405,128 @@ bool is_filename_valid(const char *filename)
 
 bool root_block_is_full()
 {
-    return _free_root_entry_cnt == 0;
+    return _fs->_free_root_entry_cnt == 0;
 }
 
 bool fs_is_mounted()
 {
-    return _mounted;
+    return _fs->_mounted;
 }
 
 void fs_unmount_procedure()
 {
-    free(_fat_section);
-    _mounted = false;
-    _free_FAT_entry_cnt = _free_root_entry_cnt = -1;
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    {
+        extent_map_free(&_fs->_open_files[i]._extent_map);
+        _fs->_open_files[i]._refcnt = 0;
+        pthread_rwlock_destroy(&_fs->_open_files[i]._lock);
+        pthread_mutex_destroy(&_fs->_open_files[i]._map_lock);
+    }
+
+    pthread_mutex_destroy(&_fs->_dir_lock);
+    pthread_mutex_destroy(&_fs->_alloc_lock);
+    aio_pool_destroy();
+
+    free_space_index_free();
+    cache_destroy();
+    fs_mount_free_fat_section();
+    _fs->_mounted = false;
+    _fs->_free_FAT_entry_cnt = _fs->_free_root_entry_cnt = -1;
+}
+
+fs_context *fs_default_context()
+{
+    return &_default_fs;
+}
+
+fs_context *fs_context_new()
+{
+    fs_context *ctx = malloc(sizeof(fs_context));
+
+    if (ctx == NULL)
+    {
+        return NULL;
+    }
+
+    *ctx = (fs_context)FS_CONTEXT_INIT;
+    ctx->_disk = block_disk_new();
+
+    if (ctx->_disk == NULL)
+    {
+        free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+void fs_context_free(fs_context *ctx)
+{
+    if (ctx == NULL || ctx == &_default_fs)
+    {
+        return;
+    }
+
+    if (_fs == ctx)
+    {
+        fs_use(&_default_fs);
+    }
+
+    block_disk_free(ctx->_disk);
+    free(ctx);
+}
+
+bool fs_use(fs_context *ctx)
+{
+    if (ctx == NULL)
+    {
+        return false;
+    }
+
+    _fs = ctx;
+    block_disk_select(ctx->_disk);
+    cache_use(&ctx->_cache);
+
+    return true;
+}
+
+void fs_lock_dir()
+{
+    pthread_mutex_lock(&_fs->_dir_lock);
+}
+
+void fs_unlock_dir()
+{
+    pthread_mutex_unlock(&_fs->_dir_lock);
+}
+
+void fs_lock_alloc()
+{
+    pthread_mutex_lock(&_fs->_alloc_lock);
+}
+
+void fs_unlock_alloc()
+{
+    pthread_mutex_unlock(&_fs->_alloc_lock);
+}
+
+void file_lock(int fd, bool exclusive)
+{
+    openfile *file = _fs->_fd_table[fd]._file;
+
+    if (exclusive)
+    {
+        pthread_rwlock_wrlock(&file->_lock);
+    }
+    else
+    {
+        pthread_rwlock_rdlock(&file->_lock);
+    }
+}
+
+void file_unlock(int fd)
+{
+    pthread_rwlock_unlock(&_fs->_fd_table[fd]._file->_lock);
 }
 
 void set_free_root_entry_cnt()
@@ -191,31 +535,32 @@ void set_free_root_entry_cnt()
 
     for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
     {
-        if (_rootdirectory._entrys[i]._first_data_blk_idx == 0)
+        if (_fs->_rootdirectory._entrys[i]._first_data_blk_idx == 0)
         {
             cnt++;
         }
     }
 
-    _free_root_entry_cnt = cnt;
+    _fs->_free_root_entry_cnt = cnt;
 }
 
 void create_new_file_on_root(const char *filename)
 {
 
-    _free_root_entry_cnt--;
+    _fs->_free_root_entry_cnt--;
 
     /* modify program root entry */
     for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
     {
-        if (_rootdirectory._entrys[i]._first_data_blk_idx == 0)
+        if (_fs->_rootdirectory._entrys[i]._first_data_blk_idx == 0)
         {
-            _rootdirectory._entrys[i]._file_size_in_bytes = 0;
-            _rootdirectory._entrys[i]._first_data_blk_idx = FAT_EOC;
-            memcpy(_rootdirectory._entrys[i]._filename, filename, strlen(filename) + 1);
+            _fs->_rootdirectory._entrys[i]._file_size_in_bytes = 0;
+            _fs->_rootdirectory._entrys[i]._first_data_blk_idx = FAT_EOC;
+            memcpy(_fs->_rootdirectory._entrys[i]._filename, filename, strlen(filename) + 1);
+            root_hash_insert(i);
 
             /* write change to root block in the disk */
-            block_write(_superblock._root_blk_strt_idx, (void *)&_rootdirectory);
+            block_write(_fs->_superblock._root_blk_strt_idx, (void *)&_fs->_rootdirectory);
 
             return;
         }
@@ -224,47 +569,32 @@ void create_new_file_on_root(const char *filename)
 
 int find_file_size(int fd)
 {
-
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
-    {
-        bool root_entry_is_valid = _rootdirectory._entrys[i]._first_data_blk_idx != 0;
-
-        if (root_entry_is_valid && strcmp((const char *)_fd_table[fd]._filename, (const char *)_rootdirectory._entrys[i]._filename) == 0)
-        {
-            return _rootdirectory._entrys[i]._file_size_in_bytes;
-        }
-    }
-
-    return -1;
+    return _fs->_fd_table[fd]._file->_file_size_in_bytes;
 }
 
 void delete_file(const char *filename)
 {
-    _free_root_entry_cnt++;
+    _fs->_free_root_entry_cnt++;
 
     uint16_t idx_of_next_data_blk = 0;
     bool file_is_empty = false;
 
     /* 1. delete file on root block */
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
-    {
-        bool root_entry_is_valid = _rootdirectory._entrys[i]._first_data_blk_idx != 0;
-
-        if (root_entry_is_valid && strcmp(filename, (const char *)_rootdirectory._entrys[i]._filename) == 0)
-        {
-            idx_of_next_data_blk = _rootdirectory._entrys[i]._first_data_blk_idx;
-            file_is_empty = _rootdirectory._entrys[i]._file_size_in_bytes == 0;
+    int i = find_root_entry_idx(filename);
 
-            /* reset root entry */
-            _rootdirectory._entrys[i]._first_data_blk_idx = 0;
-            _rootdirectory._entrys[i]._file_size_in_bytes = 0;
-            memset(_rootdirectory._entrys[i]._filename, 0, 16);
+    if (i >= 0)
+    {
+        idx_of_next_data_blk = _fs->_rootdirectory._entrys[i]._first_data_blk_idx;
+        file_is_empty = _fs->_rootdirectory._entrys[i]._file_size_in_bytes == 0;
+        root_hash_remove(i);
 
-            /* write change to root block in the disk */
-            block_write(_superblock._root_blk_strt_idx, (void *)&_rootdirectory);
+        /* reset root entry */
+        _fs->_rootdirectory._entrys[i]._first_data_blk_idx = 0;
+        _fs->_rootdirectory._entrys[i]._file_size_in_bytes = 0;
+        memset(_fs->_rootdirectory._entrys[i]._filename, 0, 16);
 
-            break;
-        }
+        /* write change to root block in the disk */
+        block_write(_fs->_superblock._root_blk_strt_idx, (void *)&_fs->_rootdirectory);
     }
 
     /* 2. delete file on fat block */
@@ -274,295 +604,1006 @@ void delete_file(const char *filename)
         return;
     }
 
+    fs_lock_alloc();
+
     /* calculate fat block index corresponding to the first data block */
     int fat_blk_idx = idx_of_next_data_blk / _num_of_fat_entries_per_block;
     int fat_entry_idx = idx_of_next_data_blk % _num_of_fat_entries_per_block;
 
     /* modify fat block data structure */
-    while (_fat_section[fat_blk_idx]._entry[fat_entry_idx] != FAT_EOC)
+    while (_fs->_fat_section[fat_blk_idx]._entry[fat_entry_idx] != FAT_EOC)
     {
-        _free_FAT_entry_cnt++;
+        free_space_index_mark_free(idx_of_next_data_blk);
+        cache_invalidate(_fs->_superblock._data_blk_strt_idx + idx_of_next_data_blk); /* never write back a freed block */
+
+        uint16_t cur_data_blk_idx = idx_of_next_data_blk;
 
-        idx_of_next_data_blk = _fat_section[fat_blk_idx]._entry[fat_entry_idx];
-        _fat_section[fat_blk_idx]._entry[fat_entry_idx] = 0;
+        idx_of_next_data_blk = _fs->_fat_section[fat_blk_idx]._entry[fat_entry_idx];
+        fat_set_entry(cur_data_blk_idx, 0);
 
         fat_blk_idx = idx_of_next_data_blk / _num_of_fat_entries_per_block;
         fat_entry_idx = idx_of_next_data_blk % _num_of_fat_entries_per_block;
     }
 
     /* handle last data block */
-    _fat_section[fat_blk_idx]._entry[fat_entry_idx] = 0;
-    _free_FAT_entry_cnt++;
+    fat_set_entry(idx_of_next_data_blk, 0);
+    free_space_index_mark_free(idx_of_next_data_blk);
+    cache_invalidate(_fs->_superblock._data_blk_strt_idx + idx_of_next_data_blk);
 
     /* write changes to fat blocks in the disk */
-    for (int i = 0; i < _superblock._total_FAT_blk_cnt; i++)
-    {
-        block_write(_fat_block_strt_idx + i, (void *)&_fat_section[i]);
-    }
+    fat_flush_dirty_blocks();
+    fs_unlock_alloc();
 }
 
-uint16_t find_data_blk_idx_by_offset(int fd)
+uint16_t find_data_blk_idx_by_offset(int fd, size_t offset, bool use_cursor)
 {
-    size_t offset = _fd_table[fd]._offset;
-
-    uint16_t data_blk_idx = find_first_data_blk_idx_of_a_file((const char *)_fd_table[fd]._filename);
     int relative_blk_idx = offset / 4096;
+    int cursor_blk_idx = use_cursor ? _fs->_fd_table[fd]._cursor_logical_blk_idx : -1;
 
-    for (int i = 0; i < relative_blk_idx; i++)
+    if (cursor_blk_idx >= 0 && (relative_blk_idx == cursor_blk_idx || relative_blk_idx == cursor_blk_idx + 1))
     {
-        data_blk_idx = find_idx_of_next_data_blk(data_blk_idx); /* go to next data blk */
+        /* sequential access, resume from the cursor with at most 1 hop */
+        if (relative_blk_idx == cursor_blk_idx)
+        {
+            return _fs->_fd_table[fd]._cursor_data_blk_idx;
+        }
+
+        return find_idx_of_next_data_blk(_fs->_fd_table[fd]._cursor_data_blk_idx);
     }
 
-    return data_blk_idx;
+    /* random access, binary search the extent map of the file */
+    return extent_map_lookup(get_extent_map(_fs->_fd_table[fd]._file), relative_blk_idx);
 }
 
-void fat_allocate_extra_entry(int num, int *actual_amount_allocated, uint16_t *idx_of_1st_new_entry)
+extentmap *get_extent_map(openfile *file)
 {
-    bool find_first = true;
-    bool quit = false;
-    int prev_section_idx = -1;
-    int prev_entry_idx = -1;
+    extentmap *map = &file->_extent_map;
 
-    *actual_amount_allocated = 0; /* at worst case, no new entry is allocated */
-
-    if (num == 0)
+    if (__atomic_load_n(&map->_built, __ATOMIC_ACQUIRE))
     {
-        return; /* no block needed to allocate */
+        return map;
     }
 
-    /* write change to superblock */
+    /* decode the whole chain once, later allocations are appended to it */
+    pthread_mutex_lock(&file->_map_lock);
 
-    for (int i = 0; i < _superblock._total_FAT_blk_cnt; i++)
+    if (!map->_built)
     {
-        for (int j = 0; j < _num_of_fat_entries_per_block; j++)
-        {
-            /* we have iterated thru all fat entries, but cannot find sufficent space */
-            if (i * _num_of_fat_entries_per_block + j + 1 > _superblock._total_data_blk_cnt)
-            {
-                quit = true;
-                break;
-            }
+        extentmap built = {._built = true};
 
-            if (_fat_section[i]._entry[j] == 0) /* 0 corresponds to free data block */
-            {
-                *actual_amount_allocated = *actual_amount_allocated + 1;
+        extent_map_append_chain(&built, 0, file->_first_data_blk_idx, -1);
+        map->_cnt = built._cnt;
+        map->_capacity = built._capacity;
+        map->_extents = built._extents;
+        __atomic_store_n(&map->_built, true, __ATOMIC_RELEASE); /* publish the extents to readers not holding _map_lock */
+    }
 
-                if (find_first)
-                {
-                    /* find the first availble block */
-                    *idx_of_1st_new_entry = i * _num_of_fat_entries_per_block + j;
-                    find_first = false;
-                }
-                else
-                {
-                    /* point prev entry to this entry */
-                    _fat_section[prev_section_idx]._entry[prev_entry_idx] = i * _num_of_fat_entries_per_block + j;
-                }
+    pthread_mutex_unlock(&file->_map_lock);
+
+    return map;
+}
 
-                /* set cur entry as prev */
-                prev_section_idx = i;
-                prev_entry_idx = j;
+void extent_map_append_chain(extentmap *map, int logical_blk_idx, uint16_t data_blk_idx, int num)
+{
+    if (!map->_built)
+    {
+        return; /* nothing to keep in sync, the map will be decoded on first use */
+    }
 
-                /* temporarily mark cur entry as eof */
-                _fat_section[i]._entry[j] = FAT_EOC;
+    /* walk @num blocks of the chain (or up to EOC if @num is negative) */
+    for (int i = 0; i != num && data_blk_idx != FAT_EOC; i++)
+    {
+        extent *last = map->_cnt > 0 ? &map->_extents[map->_cnt - 1] : NULL;
 
-                if (*actual_amount_allocated == num)
-                {
-                    /* all blocks have been allocated */
-                    quit = true;
-                    break;
-                }
+        if (last != NULL && last->_data_blk_idx + last->_len == data_blk_idx)
+        {
+            last->_len++; /* block extends the current run */
+        }
+        else
+        {
+            if (map->_cnt == map->_capacity)
+            {
+                map->_capacity = map->_capacity == 0 ? 8 : map->_capacity * 2;
+                map->_extents = realloc(map->_extents, map->_capacity * sizeof(extent));
             }
-        } // inner for
 
-        if (quit)
-        {
-            break;
+            map->_extents[map->_cnt]._logical_blk_idx = logical_blk_idx;
+            map->_extents[map->_cnt]._data_blk_idx = data_blk_idx;
+            map->_extents[map->_cnt]._len = 1;
+            map->_cnt++;
         }
-    } // outer for
 
-    /* write change to fat section */
-    for (int i = 0; i < _superblock._total_FAT_blk_cnt; i++)
-    {
-        assert(block_write(_fat_block_strt_idx + i, (void *)&_fat_section[i]) == 0);
+        logical_blk_idx++;
+        data_blk_idx = find_idx_of_next_data_blk(data_blk_idx);
     }
 }
 
-void update_idx_of_1st_data_blk_in_root(int fd, uint16_t idx)
+uint16_t extent_map_lookup(extentmap *map, int logical_blk_idx)
 {
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    int lo = 0;
+    int hi = map->_cnt - 1;
+
+    /* find the last extent starting at or before @logical_blk_idx */
+    while (lo <= hi)
     {
-        bool root_entry_is_valid = _rootdirectory._entrys[i]._first_data_blk_idx != 0;
+        int mid = (lo + hi) / 2;
 
-        if (root_entry_is_valid && strcmp((const char *)_fd_table[fd]._filename, (const char *)_rootdirectory._entrys[i]._filename) == 0)
+        if (map->_extents[mid]._logical_blk_idx <= logical_blk_idx)
         {
-            /* write change to root block */
-            _rootdirectory._entrys[i]._first_data_blk_idx = idx;
-            block_write(_superblock._root_blk_strt_idx, (void *)&_rootdirectory);
-            return;
+            lo = mid + 1;
         }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    if (hi < 0 || logical_blk_idx >= map->_extents[hi]._logical_blk_idx + map->_extents[hi]._len)
+    {
+        return FAT_EOC; /* past the end of the file */
     }
+
+    return map->_extents[hi]._data_blk_idx + (logical_blk_idx - map->_extents[hi]._logical_blk_idx);
 }
 
-void update_last_fat_entry_of_a_file(int fd, uint16_t new_entry)
+int find_extent_cnt(int fd)
+{
+    return get_extent_map(_fs->_fd_table[fd]._file)->_cnt;
+}
+
+void extent_map_free(extentmap *map)
+{
+    free(map->_extents);
+    memset(map, 0, sizeof(extentmap));
+}
+
+void fat_allocate_extra_entry(int num, uint16_t tail_data_blk_idx, int *actual_amount_allocated, uint16_t *idx_of_1st_new_entry, uint16_t *idx_of_last_new_entry)
 {
-    /* find idx of first fat entry of the file */
-    uint16_t data_blk_idx = find_first_data_blk_idx_of_a_file((const char *)_fd_table[fd]._filename);
+    int prev_data_blk_idx = -1;
+
+    *actual_amount_allocated = 0; /* at worst case, no new entry is allocated */
 
-    while (data_blk_idx != FAT_EOC)
+    if (num == 0)
     {
-        data_blk_idx = find_idx_of_next_data_blk(data_blk_idx);
+        return; /* no block needed to allocate */
     }
 
-    /* write change to fat block */
-    _fat_section[data_blk_idx / 2048]._entry[data_blk_idx % 2048] = new_entry;
-    assert(block_write(_fat_block_strt_idx + (data_blk_idx / 2048), &_fat_section[data_blk_idx / 2048]) == 0);
-}
+    /* 1. grow the file in place if the blocks right after its tail are free */
+    if (tail_data_blk_idx != FAT_EOC)
+    {
+        int run_len = free_space_index_run_len(tail_data_blk_idx + 1, num);
 
-void update_file_size(int fd, uint32_t size)
-{
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+        fat_allocate_run(tail_data_blk_idx + 1, run_len, &prev_data_blk_idx, actual_amount_allocated, idx_of_1st_new_entry);
+    }
+
+    /* 2. place the rest in the best fitting free run, splitting it only when no run is large enough */
+    while (*actual_amount_allocated < num)
     {
-        bool root_entry_is_valid = _rootdirectory._entrys[i]._first_data_blk_idx != 0;
+        int run_len = 0;
+        int run_strt_idx = free_space_index_find_best_fit(num - *actual_amount_allocated, &run_len);
 
-        if (root_entry_is_valid && strcmp((const char *)_fd_table[fd]._filename, (const char *)_rootdirectory._entrys[i]._filename) == 0)
+        if (run_strt_idx < 0)
         {
-            /* write change to root block */
-            _rootdirectory._entrys[i]._file_size_in_bytes = size;
-            block_write(_superblock._root_blk_strt_idx, (void *)&_rootdirectory);
-            return;
+            break; /* disk runs out of space */
         }
+
+        fat_allocate_run(run_strt_idx, run_len, &prev_data_blk_idx, actual_amount_allocated, idx_of_1st_new_entry);
     }
-}
 
-int fs_write_impl(int fd, void *buf, size_t count)
-{
-    if (count <= 0)
+    if (prev_data_blk_idx >= 0)
     {
-        return 0; /* nothing to write to the disk */
+        *idx_of_last_new_entry = prev_data_blk_idx;
     }
 
-    /* 1. allocate additonal fat block if needed */
-    int cur_file_size = find_file_size(fd);
-    int cur_total_byte_allocated = fat_ceil(cur_file_size);
-    int cur_file_offset = _fd_table[fd]._offset;
+    /* the caller links the new chain and flushes the fat once */
+}
 
-    if (cur_file_offset + count > cur_total_byte_allocated)
+void fat_allocate_run(int run_strt_idx, int run_len, int *prev_data_blk_idx, int *actual_amount_allocated, uint16_t *idx_of_1st_new_entry)
+{
+    for (int data_blk_idx = run_strt_idx; data_blk_idx < run_strt_idx + run_len; data_blk_idx++)
     {
-        /* start allocating extra fat entry */
-        int num_of_extra_entry_needed = (fat_ceil(cur_file_offset + count) - cur_total_byte_allocated) / 4096;
-        int actual_amount_allocated = 10000;       /* could be less than amount required if disk runs out of space */
-        uint16_t idx_of_1st_new_fat_entry = 10000; /* we need this to concatnate the last entry of the original file */
+        free_space_index_mark_used(data_blk_idx);
 
-        fat_allocate_extra_entry(num_of_extra_entry_needed, &actual_amount_allocated, &idx_of_1st_new_fat_entry);
-
-        if (actual_amount_allocated < num_of_extra_entry_needed)
+        if (*prev_data_blk_idx < 0)
+        {
+            /* find the first availble block */
+            *idx_of_1st_new_entry = data_blk_idx;
+        }
+        else
+        {
+            /* point prev entry to this entry */
+            fat_set_entry(*prev_data_blk_idx, data_blk_idx);
+        }
+
+        /* temporarily mark cur entry as eof */
+        fat_set_entry(data_blk_idx, FAT_EOC);
+
+        *prev_data_blk_idx = data_blk_idx;
+        *actual_amount_allocated = *actual_amount_allocated + 1;
+    }
+
+    if (run_len > 0)
+    {
+        _fs->_next_fit_cursor = (run_strt_idx + run_len) % _fs->_superblock._total_data_blk_cnt;
+    }
+}
+
+void update_idx_of_1st_data_blk_in_root(int fd, uint16_t idx)
+{
+    openfile *file = _fs->_fd_table[fd]._file;
+
+    /* write change to root block */
+    file->_first_data_blk_idx = idx;
+    fs_lock_dir();
+    _fs->_rootdirectory._entrys[file->_root_entry_idx]._first_data_blk_idx = idx;
+    block_write(_fs->_superblock._root_blk_strt_idx, (void *)&_fs->_rootdirectory);
+    fs_unlock_dir();
+}
+
+void update_last_fat_entry_of_a_file(int fd, uint16_t new_entry)
+{
+    /* the tail is cached, so linking new blocks does not walk the chain */
+    uint16_t data_blk_idx = find_tail_data_blk_idx_of_a_file(_fs->_fd_table[fd]._file);
+
+    /* modify fat block, written back by the caller */
+    fat_set_entry(data_blk_idx, new_entry);
+}
+
+uint16_t find_tail_data_blk_idx_of_a_file(openfile *file)
+{
+    if (file->_tail_data_blk_idx == 0)
+    {
+        /* first lookup since the file was opened, walk the chain up to the block whose next entry is EOC */
+        uint16_t data_blk_idx = file->_first_data_blk_idx;
+
+        while (data_blk_idx != FAT_EOC && find_idx_of_next_data_blk(data_blk_idx) != FAT_EOC)
+        {
+            data_blk_idx = find_idx_of_next_data_blk(data_blk_idx);
+        }
+
+        file->_tail_data_blk_idx = data_blk_idx;
+    }
+
+    return file->_tail_data_blk_idx;
+}
+
+void fat_set_entry(uint16_t data_blk_idx, uint16_t value)
+{
+    _fs->_fat_section[data_blk_idx / 2048]._entry[data_blk_idx % 2048] = value;
+    _fs->_fat_blk_dirty[data_blk_idx / 2048] = true;
+}
+
+int fat_flush_dirty_blocks()
+{
+    int cnt = 0;
+    iobatch batch; /* dirty fat blocks are written concurrently */
+
+    batch._cnt = 0;
+
+    for (int i = 0; i < _fs->_superblock._total_FAT_blk_cnt; i++)
+    {
+        if (_fs->_fat_blk_dirty[i])
+        {
+            struct iovec *iov = iobatch_next_iov(&batch);
+
+            iov[0].iov_base = (void *)&_fs->_fat_section[i];
+            iov[0].iov_len = 4096;
+            iobatch_submit(&batch, _fat_block_strt_idx + i, 1, true);
+
+            _fs->_fat_blk_dirty[i] = false;
+            cnt++;
+        }
+    }
+
+    iobatch_wait(&batch);
+
+    return cnt;
+}
+
+void update_file_size(int fd, uint32_t size)
+{
+    openfile *file = _fs->_fd_table[fd]._file;
+
+    /* write change to root block */
+    file->_file_size_in_bytes = size;
+    fs_lock_dir();
+    _fs->_rootdirectory._entrys[file->_root_entry_idx]._file_size_in_bytes = size;
+    block_write(_fs->_superblock._root_blk_strt_idx, (void *)&_fs->_rootdirectory);
+    fs_unlock_dir();
+}
+
+int fs_write_impl(int fd, const struct iovec *bufs, int bufcnt, size_t offset, bool move_offset)
+{
+    size_t count = iov_total_len(bufs, bufcnt);
+
+    if (count <= 0)
+    {
+        return 0; /* nothing to write to the disk */
+    }
+
+    /* 1. allocate additonal fat block if needed */
+    int cur_file_size = find_file_size(fd);
+    int cur_total_byte_allocated = fat_ceil(cur_file_size);
+    int cur_file_offset = offset;
+
+    if (cur_file_offset + count > cur_total_byte_allocated)
+    {
+        /* start allocating extra fat entry */
+        int num_of_extra_entry_needed = (fat_ceil(cur_file_offset + count) - cur_total_byte_allocated) / 4096;
+        int actual_amount_allocated = 10000;       /* could be less than amount required if disk runs out of space */
+        uint16_t idx_of_1st_new_fat_entry = 10000; /* we need this to concatnate the last entry of the original file */
+
+        uint16_t idx_of_last_new_fat_entry = 10000; /* new tail of the file */
+        openfile *file = _fs->_fd_table[fd]._file;
+
+        /* try to keep growing the file from its current tail */
+        fs_lock_alloc();
+        fat_allocate_extra_entry(num_of_extra_entry_needed, find_tail_data_blk_idx_of_a_file(file),
+                                 &actual_amount_allocated, &idx_of_1st_new_fat_entry, &idx_of_last_new_fat_entry);
+
+        if (actual_amount_allocated < num_of_extra_entry_needed)
         {
             /* truncate number of bytes to write */
             count = (fat_ceil(cur_file_size) - cur_file_offset) + 4096 * actual_amount_allocated;
         }
 
-        if (cur_file_size == 0)
-        {
-            /* if file is currently empty, need to update index of the first data block on root */
-            update_idx_of_1st_data_blk_in_root(fd, idx_of_1st_new_fat_entry);
-        }
-        else
+        if (actual_amount_allocated > 0 && cur_file_size != 0)
+        {
+            /* file is currently not empty, need to update the last fat entry */
+            update_last_fat_entry_of_a_file(fd, idx_of_1st_new_fat_entry);
+        }
+
+        /* write the new chain to the fat blocks it touched, and only those */
+        fat_flush_dirty_blocks();
+        fs_unlock_alloc();
+
+        if (count == 0)
+        {
+            return 0; /* disk is full */
+        }
+
+        if (actual_amount_allocated > 0)
+        {
+            if (cur_file_size == 0)
+            {
+                /* if file is currently empty, need to update index of the first data block on root */
+                update_idx_of_1st_data_blk_in_root(fd, idx_of_1st_new_fat_entry);
+            }
+
+            /* keep the tail and the extent map of the file in sync with the new end of the chain */
+            file->_tail_data_blk_idx = idx_of_last_new_fat_entry;
+            extent_map_append_chain(&file->_extent_map, cur_total_byte_allocated / 4096, idx_of_1st_new_fat_entry, actual_amount_allocated);
+        }
+    }
+
+    /* 2. write contents to the disk, the logic is mostly identical to fs_read_impl() */
+    uint16_t data_blk_idx = find_data_blk_idx_by_offset(fd, cur_file_offset, move_offset); /* find index of first data block */
+    int logical_blk_idx = cur_file_offset / 4096;
+    int first_new_logical_blk_idx = cur_total_byte_allocated / 4096; /* blocks from here on were just allocated */
+    int buf_offset = 0;
+    int remaining_bytes_to_write = count;
+    int in_blk_offset = cur_file_offset % 4096; /* in_blk_offset lies in between 0 and 4095 */
+    uint8_t head_blk[4096];                     /* staging buffers for the unaligned first and last blocks */
+    uint8_t tail_blk[4096];
+    uint8_t spill_blk[4096];                    /* a whole block spread over too many buffers to fit a request */
+    iovcursor src;                              /* where the bytes to write come from */
+    bool small_write = (in_blk_offset + count + 4095) / 4096 <= CACHE_SMALL_IO_BLK_CNT; /* absorbed by the cache */
+    iobatch batch; /* runs are written concurrently */
+
+    batch._cnt = 0;
+    iov_cursor_init(&src, bufs, bufcnt);
+
+    while (remaining_bytes_to_write != 0)
+    {
+        /* gather a run of physically contiguous blocks and write it with a single call */
+        uint16_t run_strt_idx = data_blk_idx;
+        struct iovec *iov = iobatch_next_iov(&batch); /* [staged head] [input buffers] [staged tail] */
+        int iovcnt = 0;
+
+        while (true)
+        {
+            int num_of_bytes_to_write_to_this_blk = 4096 - in_blk_offset;
+
+            if (num_of_bytes_to_write_to_this_blk > remaining_bytes_to_write)
+            {
+                num_of_bytes_to_write_to_this_blk = remaining_bytes_to_write; /* last blk to write */
+            }
+
+            size_t disk_blk_idx = _fs->_superblock._data_blk_strt_idx + data_blk_idx;
+            bool is_new_blk = logical_blk_idx >= first_new_logical_blk_idx;
+
+            /* partial blocks and small writes stay in the cache, large writes stream to disk unless the block is cached */
+            bool via_cache = cache_enabled() && (num_of_bytes_to_write_to_this_blk != 4096 || small_write);
+            int piece_cnt = num_of_bytes_to_write_to_this_blk == 4096 ? iov_piece_cnt(&src, buf_offset, 4096) : 1;
+
+            if (iovcnt > 0 && (via_cache || iovcnt + piece_cnt > IOBATCH_MAX_IOVS || cache_contains(disk_blk_idx)))
+            {
+                break; /* write the run gathered so far, this block starts the next one */
+            }
+
+            uint8_t *cached_blk = via_cache ? cache_grab(disk_blk_idx, num_of_bytes_to_write_to_this_blk != 4096 && !is_new_blk)
+                                            : cache_lookup(disk_blk_idx);
+
+            if (cached_blk != NULL)
+            {
+                if (num_of_bytes_to_write_to_this_blk != 4096 && is_new_blk)
+                {
+                    memset(cached_blk, 0, 4096); /* freshly allocated block, nothing on disk to preserve */
+                }
+
+                iov_gather(&src, buf_offset, cached_blk + in_blk_offset, num_of_bytes_to_write_to_this_blk);
+                cache_release(disk_blk_idx, true); /* written back on eviction, fs_sync() or fs_umount() */
+            }
+            else if (num_of_bytes_to_write_to_this_blk == 4096 && piece_cnt > IOBATCH_MAX_IOVS)
+            {
+                /* the run is empty, gathering the block is cheaper than splitting it over requests */
+                iov_gather(&src, buf_offset, spill_blk, 4096);
+                assert(block_write(disk_blk_idx, (void *)spill_blk) == 0);
+            }
+            else if (num_of_bytes_to_write_to_this_blk == 4096)
+            {
+                /* whole block is overwritten, write it straight from the input buffers */
+                iov_append(&src, buf_offset, 4096, iov, &iovcnt);
+            }
+            else
+            {
+                /* only the first and last block of a write can be partial */
+                uint8_t *data_blk = buf_offset == 0 ? head_blk : tail_blk;
+
+                if (is_new_blk)
+                {
+                    memset(data_blk, 0, 4096); /* freshly allocated block, nothing on disk to preserve */
+                }
+                else
+                {
+                    assert(block_read(disk_blk_idx, (void *)data_blk) == 0); /* fetch data block */
+                }
+
+                iov_gather(&src, buf_offset, data_blk + in_blk_offset, num_of_bytes_to_write_to_this_blk); /* input_buf => data_buf */
+                iov[iovcnt].iov_base = data_blk;
+                iov[iovcnt].iov_len = 4096;
+                iovcnt++;
+            }
+
+            remaining_bytes_to_write -= num_of_bytes_to_write_to_this_blk;
+            buf_offset += num_of_bytes_to_write_to_this_blk;
+            in_blk_offset = 0; /* for next blk, we will write from start */
+
+            if (remaining_bytes_to_write == 0)
+            {
+                break;
+            }
+
+            uint16_t next_data_blk_idx = find_idx_of_next_data_blk(data_blk_idx);
+
+            if (iovcnt == 0)
+            {
+                run_strt_idx = next_data_blk_idx; /* block went to the cache or on its own, the run has not started yet */
+            }
+            else if (next_data_blk_idx != data_blk_idx + 1)
+            {
+                /* the run ends here, continue with a new one after this write */
+                data_blk_idx = next_data_blk_idx;
+                logical_blk_idx++;
+                break;
+            }
+
+            data_blk_idx = next_data_blk_idx;
+            logical_blk_idx++;
+        }
+
+        if (iovcnt > 0)
+        {
+            iobatch_submit(&batch, _fs->_superblock._data_blk_strt_idx + run_strt_idx, iovcnt, true); /* data_buf => disk */
+        }
+    }
+
+    iobatch_wait(&batch);
+
+    if (move_offset)
+    {
+        set_fd_cursor(fd, logical_blk_idx, data_blk_idx); /* remember the last block we touched */
+        _fs->_fd_table[fd]._offset += count; /* increment fd offset by the amount we write */
+    }
+
+    /* update file size if necessary */
+    if (cur_file_offset + count > cur_file_size)
+    {
+        update_file_size(fd, (uint32_t)(cur_file_offset + count));
+    }
+
+    return count;
+}
+
+int fs_read_impl(int fd, const struct iovec *bufs, int bufcnt, size_t offset, bool move_offset)
+{
+    int file_size = find_file_size(fd);
+    size_t count = iov_total_len(bufs, bufcnt);
+
+    if (offset == file_size || count <= 0)
+    {
+        return 0; /* already at eof or non-positive value of count  */
+    }
+
+    if (offset + count > file_size)
+    {
+        count = file_size - offset; /* truncate number of bytes to read */
+    }
+
+    bool sequential = move_offset && offset == _fs->_fd_table[fd]._ra_next_offset; /* continues the previous read */
+    int ra_end_logical_blk_idx = move_offset ? _fs->_fd_table[fd]._ra_end_logical_blk_idx : 0;
+    int ra_missed_blk_cnt = 0;                                                 /* read ahead blocks evicted before use */
+    uint16_t data_blk_idx = find_data_blk_idx_by_offset(fd, offset, move_offset); /* find index of first data block */
+    int logical_blk_idx = offset / 4096;
+    int buf_offset = 0;
+    int remaining_bytes_to_read = count;
+    int in_blk_offset = offset % 4096; /* in_blk_offset lies in between 0 and 4095 */
+    uint8_t head_blk[4096];                           /* staging buffers for the unaligned first and last blocks */
+    uint8_t tail_blk[4096];
+    uint8_t spill_blk[4096];                          /* a whole block spread over too many buffers to fit a request */
+    iovcursor dst;                                    /* where the bytes read go */
+    int head_in_blk_offset = in_blk_offset;
+    int head_len = 0, tail_len = 0, tail_buf_offset = 0;
+    bool small_read = (in_blk_offset + count + 4095) / 4096 <= CACHE_SMALL_IO_BLK_CNT; /* keep what it reads in the cache */
+    size_t fill_blk_idx[CACHE_SMALL_IO_BLK_CNT];      /* blocks read from disk to copy into the cache afterwards */
+    uint8_t *fill_data[CACHE_SMALL_IO_BLK_CNT];
+    int fill_cnt = 0;
+    iobatch batch; /* runs are read concurrently */
+
+    batch._cnt = 0;
+    iov_cursor_init(&dst, bufs, bufcnt);
+
+    while (remaining_bytes_to_read != 0)
+    {
+        /* gather a run of physically contiguous blocks and read it with a single call */
+        uint16_t run_strt_idx = data_blk_idx;
+        struct iovec *iov = iobatch_next_iov(&batch); /* [staged head] [output buffers] [staged tail] */
+        int iovcnt = 0;
+
+        while (true)
+        {
+            int num_of_bytes_to_read_from_this_blk = 4096 - in_blk_offset;
+
+            if (num_of_bytes_to_read_from_this_blk > remaining_bytes_to_read)
+            {
+                num_of_bytes_to_read_from_this_blk = remaining_bytes_to_read; /* last blk to read */
+            }
+
+            size_t disk_blk_idx = _fs->_superblock._data_blk_strt_idx + data_blk_idx;
+            int piece_cnt = num_of_bytes_to_read_from_this_blk == 4096 ? iov_piece_cnt(&dst, buf_offset, 4096) : 1;
+
+            if (iovcnt > 0 && (iovcnt + piece_cnt > IOBATCH_MAX_IOVS || cache_contains(disk_blk_idx)))
+            {
+                break; /* read the run gathered so far, this block starts the next one */
+            }
+
+            uint8_t *cached_blk = cache_lookup(disk_blk_idx);
+
+            if (cached_blk != NULL && iovcnt > 0)
+            {
+                /* read ahead by another reader since cache_contains(), the run cannot skip over it */
+                cache_release(disk_blk_idx, false);
+                break;
+            }
+
+            if (cached_blk == NULL && logical_blk_idx < ra_end_logical_blk_idx)
+            {
+                ra_missed_blk_cnt++;
+            }
+
+            if (cached_blk != NULL)
+            {
+                /* served from the cache, no disk access */
+                iov_scatter(&dst, buf_offset, cached_blk + in_blk_offset, num_of_bytes_to_read_from_this_blk);
+                cache_release(disk_blk_idx, false);
+            }
+            else if (num_of_bytes_to_read_from_this_blk == 4096 && piece_cnt > IOBATCH_MAX_IOVS)
+            {
+                /* the run is empty, reading the block on its own is cheaper than splitting it over requests */
+                assert(block_read(disk_blk_idx, (void *)spill_blk) == 0);
+                iov_scatter(&dst, buf_offset, spill_blk, 4096);
+            }
+            else if (num_of_bytes_to_read_from_this_blk == 4096)
+            {
+                /* aligned full block, read it straight into the output buffers */
+                iov_append(&dst, buf_offset, 4096, iov, &iovcnt);
+
+                if (small_read && fill_cnt < CACHE_SMALL_IO_BLK_CNT && piece_cnt == 1)
+                {
+                    fill_blk_idx[fill_cnt] = disk_blk_idx;
+                    fill_data[fill_cnt++] = iov[iovcnt - 1].iov_base + iov[iovcnt - 1].iov_len - 4096;
+                }
+            }
+            else
+            {
+                /* unaligned head or tail goes through a staging buffer, copied out once all runs are read */
+                if (buf_offset == 0)
+                {
+                    iov[iovcnt].iov_base = head_blk;
+                    head_len = num_of_bytes_to_read_from_this_blk;
+                }
+                else
+                {
+                    iov[iovcnt].iov_base = tail_blk;
+                    tail_len = num_of_bytes_to_read_from_this_blk;
+                    tail_buf_offset = buf_offset;
+                }
+
+                iov[iovcnt].iov_len = 4096;
+                iovcnt++;
+
+                if (fill_cnt < CACHE_SMALL_IO_BLK_CNT)
+                {
+                    /* partial blocks are likely to be accessed again by the next small request */
+                    fill_blk_idx[fill_cnt] = disk_blk_idx;
+                    fill_data[fill_cnt++] = iov[iovcnt - 1].iov_base;
+                }
+            }
+
+            remaining_bytes_to_read -= num_of_bytes_to_read_from_this_blk;
+            buf_offset += num_of_bytes_to_read_from_this_blk;
+            in_blk_offset = 0; /* for next blk, we will read from start */
+
+            if (remaining_bytes_to_read == 0)
+            {
+                break;
+            }
+
+            uint16_t next_data_blk_idx = find_idx_of_next_data_blk(data_blk_idx);
+
+            if (iovcnt == 0)
+            {
+                run_strt_idx = next_data_blk_idx; /* block came from the cache or on its own, the run has not started yet */
+            }
+            else if (next_data_blk_idx != data_blk_idx + 1)
+            {
+                /* the run ends here, continue with a new one after this read */
+                data_blk_idx = next_data_blk_idx;
+                logical_blk_idx++;
+                break;
+            }
+
+            data_blk_idx = next_data_blk_idx;
+            logical_blk_idx++;
+        }
+
+        if (iovcnt > 0)
+        {
+            iobatch_submit(&batch, _fs->_superblock._data_blk_strt_idx + run_strt_idx, iovcnt, false);
+        }
+    }
+
+    iobatch_wait(&batch); /* staging buffers are filled once every run is read */
+
+    for (int i = 0; i < fill_cnt; i++)
+    {
+        cache_fill(fill_blk_idx[i], fill_data[i]);
+    }
+
+    if (head_len > 0)
+    {
+        iov_scatter(&dst, 0, head_blk + head_in_blk_offset, head_len);
+    }
+
+    if (tail_len > 0)
+    {
+        iov_scatter(&dst, tail_buf_offset, tail_blk, tail_len);
+    }
+
+    if (move_offset)
+    {
+        set_fd_cursor(fd, logical_blk_idx, data_blk_idx); /* remember the last block we touched */
+        _fs->_fd_table[fd]._offset += count; /* increment fd offset by the amount we read */
+
+        fd_readahead(fd, sequential, ra_missed_blk_cnt); /* keep the blocks after this read coming */
+    }
+
+    return count;
+}
+
+struct iovec *iobatch_next_iov(iobatch *batch)
+{
+    return batch->_iovs[batch->_cnt];
+}
+
+void iobatch_submit(iobatch *batch, size_t blk_idx, int iovcnt, bool write)
+{
+    struct block_aio *req = &batch->_reqs[batch->_cnt];
+
+    req->block = blk_idx;
+    req->iov = batch->_iovs[batch->_cnt];
+    req->iovcnt = iovcnt;
+    req->write = write;
+    block_aio_submit(req); /* a failed submit completes the request with an error, caught when waiting */
+
+    batch->_cnt++;
+
+    if (batch->_cnt == IOBATCH_MAX_REQS)
+    {
+        iobatch_wait(batch); /* batch is full, drain it before reusing the slots */
+    }
+}
+
+void iobatch_wait(iobatch *batch)
+{
+    for (int i = 0; i < batch->_cnt; i++)
+    {
+        assert(block_aio_wait(&batch->_reqs[i]) == 0);
+    }
+
+    batch->_cnt = 0;
+}
+
+size_t iov_total_len(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        len += iov[i].iov_len;
+    }
+
+    return len;
+}
+
+void iov_cursor_init(iovcursor *cur, const struct iovec *iov, int iovcnt)
+{
+    cur->_iov = iov;
+    cur->_iovcnt = iovcnt;
+    cur->_idx = 0;
+    cur->_idx_strt = 0;
+}
+
+void iov_cursor_seek(iovcursor *cur, size_t pos)
+{
+    if (pos < cur->_idx_strt)
+    {
+        iov_cursor_init(cur, cur->_iov, cur->_iovcnt); /* positions mostly grow, rewinding is rare */
+    }
+
+    while (cur->_idx < cur->_iovcnt && pos >= cur->_idx_strt + cur->_iov[cur->_idx].iov_len)
+    {
+        cur->_idx_strt += cur->_iov[cur->_idx].iov_len;
+        cur->_idx++;
+    }
+}
+
+/* visit the pieces of [pos, pos + len) in the buffers: copy them from or to data, or append them to dst */
+int iov_walk(iovcursor *cur, size_t pos, size_t len, uint8_t *data, bool to_iov, struct iovec *dst, int *dstcnt)
+{
+    int piece_cnt = 0;
+
+    iov_cursor_seek(cur, pos);
+
+    for (int i = cur->_idx; len > 0; i++)
+    {
+        size_t in_iov_offset = i == cur->_idx ? pos - cur->_idx_strt : 0;
+        size_t n = cur->_iov[i].iov_len - in_iov_offset < len ? cur->_iov[i].iov_len - in_iov_offset : len;
+        uint8_t *piece = (uint8_t *)cur->_iov[i].iov_base + in_iov_offset;
+
+        if (n == 0)
+        {
+            continue;
+        }
+
+        if (dst != NULL && *dstcnt > 0 && dst[*dstcnt - 1].iov_base + dst[*dstcnt - 1].iov_len == piece)
+        {
+            dst[*dstcnt - 1].iov_len += n; /* continues the previous buffer */
+        }
+        else if (dst != NULL)
+        {
+            dst[*dstcnt].iov_base = piece;
+            dst[*dstcnt].iov_len = n;
+            (*dstcnt)++;
+        }
+        else if (data != NULL)
+        {
+            memcpy(to_iov ? piece : data, to_iov ? data : piece, n);
+            data += n;
+        }
+
+        len -= n;
+        piece_cnt++;
+    }
+
+    return piece_cnt;
+}
+
+int iov_piece_cnt(iovcursor *cur, size_t pos, size_t len)
+{
+    return iov_walk(cur, pos, len, NULL, false, NULL, NULL);
+}
+
+void iov_gather(iovcursor *cur, size_t pos, uint8_t *data, size_t len)
+{
+    iov_walk(cur, pos, len, data, false, NULL, NULL);
+}
+
+void iov_scatter(iovcursor *cur, size_t pos, const uint8_t *data, size_t len)
+{
+    iov_walk(cur, pos, len, (uint8_t *)data, true, NULL, NULL);
+}
+
+void iov_append(iovcursor *cur, size_t pos, size_t len, struct iovec *dst, int *dstcnt)
+{
+    iov_walk(cur, pos, len, NULL, false, dst, dstcnt);
+}
+
+void aio_pool_init()
+{
+    aiopool *pool = &_fs->_aio;
+
+    pthread_mutex_init(&pool->_lock, NULL);
+    pthread_cond_init(&pool->_submitted, NULL);
+    pthread_cond_init(&pool->_completed, NULL);
+    pool->_worker_cnt = 0;
+    pool->_stopping = false;
+    pool->_pending_head = pool->_pending_tail = NULL;
+    pool->_done_head = pool->_done_tail = NULL;
+    pool->_inflight_cnt = pool->_unpolled_cnt = 0;
+}
+
+void aio_pool_destroy()
+{
+    pthread_mutex_destroy(&_fs->_aio._lock);
+    pthread_cond_destroy(&_fs->_aio._submitted);
+    pthread_cond_destroy(&_fs->_aio._completed);
+}
+
+bool aio_pool_start()
+{
+    aiopool *pool = &_fs->_aio;
+    const char *worker_cnt = getenv("LIBFS_AIO_WORKERS");
+    int cnt = worker_cnt ? atoi(worker_cnt) : AIOPOOL_DEFAULT_WORKER_CNT;
+
+    cnt = cnt < 1 ? 1 : cnt > AIOPOOL_MAX_WORKER_CNT ? AIOPOOL_MAX_WORKER_CNT : cnt;
+
+    for (pool->_worker_cnt = 0; pool->_worker_cnt < cnt; pool->_worker_cnt++)
+    {
+        if (pthread_create(&pool->_workers[pool->_worker_cnt], NULL, aio_pool_worker, _fs) != 0)
         {
-            /* file is currently not empty, need to update the last fat entry */
-            update_last_fat_entry_of_a_file(fd, idx_of_1st_new_fat_entry);
+            break; /* make do with the workers we have */
         }
     }
 
-    /* 2. write contents to the disk, the logic is mostly identical to fs_read_impl() */
-    uint16_t data_blk_idx = find_data_blk_idx_by_offset(fd); /* find index of first data block */
-    int buf_offset = 0;
-    int remaining_bytes_to_write = count;
-    int in_blk_offset = cur_file_offset % 4096; /* in_blk_offset lies in between 0 and 4095 */
-    uint8_t data_blk[4096];
+    return pool->_worker_cnt > 0;
+}
 
-    assert(block_read(_superblock._data_blk_strt_idx + data_blk_idx, (void *)data_blk) == 0);
+void aio_pool_stop()
+{
+    aiopool *pool = &_fs->_aio;
 
-    while (remaining_bytes_to_write != 0)
+    pthread_mutex_lock(&pool->_lock);
+    pool->_stopping = true;
+    pthread_cond_broadcast(&pool->_submitted);
+    pthread_mutex_unlock(&pool->_lock);
+
+    /* workers only leave once nothing is pending, so every request has finished after this */
+    for (int i = 0; i < pool->_worker_cnt; i++)
+    {
+        pthread_join(pool->_workers[i], NULL);
+    }
+
+    pool->_worker_cnt = 0;
+    pool->_stopping = false;
+}
+
+void *aio_pool_worker(void *arg)
+{
+    fs_context *ctx = arg;
+    aiopool *pool = &ctx->_aio;
+
+    pthread_mutex_lock(&pool->_lock);
+
+    while (true)
     {
-        if (in_blk_offset + remaining_bytes_to_write <= 4096) /* last blk to write */
+        while (pool->_pending_head == NULL && !pool->_stopping)
         {
-            memcpy(data_blk + in_blk_offset, buf + buf_offset, remaining_bytes_to_write);              /* input_buf => data_buf */
-            assert(block_write(_superblock._data_blk_strt_idx + data_blk_idx, (void *)data_blk) == 0); /* data_buf => disk */
-            break;
+            pthread_cond_wait(&pool->_submitted, &pool->_lock);
         }
-        else
+
+        struct fs_aio *req = pool->_pending_head;
+
+        if (req == NULL)
         {
-            int num_of_bytes_to_write_to_this_blk = 4096 - in_blk_offset;
-            remaining_bytes_to_write -= num_of_bytes_to_write_to_this_blk;
+            break; /* stopping and nothing left to run */
+        }
 
-            memcpy(data_blk + in_blk_offset, buf + buf_offset, num_of_bytes_to_write_to_this_blk);     /* input_buf => data_buf */
-            assert(block_write(_superblock._data_blk_strt_idx + data_blk_idx, (void *)data_blk) == 0); /* data_buf => disk */
+        pool->_pending_head = req->next;
+        pool->_pending_tail = pool->_pending_head == NULL ? NULL : pool->_pending_tail;
+        pthread_mutex_unlock(&pool->_lock);
 
-            in_blk_offset = 0; /* for next blk, we will write from start */
-            buf_offset += num_of_bytes_to_write_to_this_blk;
-            data_blk_idx = find_idx_of_next_data_blk(data_blk_idx);
+        /* file lock, offset check and block I/O as for the synchronous calls, other workers run meanwhile */
+        req->result = req->write ? fs_pwrite_ctx(ctx, req->fd, req->buf, req->count, req->offset)
+                                 : fs_pread_ctx(ctx, req->fd, req->buf, req->count, req->offset);
 
-            assert(block_read(_superblock._data_blk_strt_idx + data_blk_idx, (void *)data_blk) == 0); /* fetch next data block */
+        if (req->callback != NULL)
+        {
+            req->callback(req); /* req may be gone after this */
+            pthread_mutex_lock(&pool->_lock);
         }
-    }
+        else
+        {
+            pthread_mutex_lock(&pool->_lock);
+            req->next = NULL;
+
+            if (pool->_done_tail == NULL)
+            {
+                pool->_done_head = req;
+            }
+            else
+            {
+                pool->_done_tail->next = req;
+            }
 
-    _fd_table[fd]._offset += count; /* increment fd offset by the amount we write */
+            pool->_done_tail = req;
+        }
 
-    /* update file size if necessary */
-    if (cur_file_offset + count > cur_file_size)
-    {
-        update_file_size(fd, (uint32_t)(cur_file_offset + count));
+        pool->_inflight_cnt--;
+        pthread_cond_broadcast(&pool->_completed);
     }
 
-    return count;
+    pthread_mutex_unlock(&pool->_lock);
+
+    return NULL;
 }
 
-int fs_read_impl(int fd, void *buf, size_t count)
+bool aio_pool_submit(struct fs_aio *req)
 {
-    int file_size = find_file_size(fd);
+    aiopool *pool = &_fs->_aio;
+
+    pthread_mutex_lock(&pool->_lock);
 
-    if (_fd_table[fd]._offset == file_size || count <= 0)
+    if (pool->_worker_cnt == 0 && !aio_pool_start())
     {
-        return 0; /* already at eof or non-positive value of count  */
+        pthread_mutex_unlock(&pool->_lock);
+        return false;
     }
 
-    if (_fd_table[fd]._offset + count > file_size)
+    req->ctx = _fs;
+    req->next = NULL;
+
+    if (pool->_pending_tail == NULL)
+    {
+        pool->_pending_head = req;
+    }
+    else
     {
-        count = file_size - _fd_table[fd]._offset; /* truncate number of bytes to read */
+        pool->_pending_tail->next = req;
     }
 
-    uint16_t data_blk_idx = find_data_blk_idx_by_offset(fd); /* find index of first data block */
-    int buf_offset = 0;
-    int remaining_bytes_to_read = count;
-    int in_blk_offset = _fd_table[fd]._offset % 4096; /* in_blk_offset lies in between 0 and 4095 */
-    uint8_t data_blk[4096];
+    pool->_pending_tail = req;
+    pool->_inflight_cnt++;
+    pool->_unpolled_cnt += req->callback == NULL;
+    pthread_cond_signal(&pool->_submitted);
+    pthread_mutex_unlock(&pool->_lock);
 
-    assert(block_read(_superblock._data_blk_strt_idx + data_blk_idx, (void *)data_blk) == 0); /* read first data block */
+    return true;
+}
 
-    while (remaining_bytes_to_read != 0)
+int aio_pool_poll(struct fs_aio **reqs, int max, bool wait)
+{
+    aiopool *pool = &_fs->_aio;
+    int cnt = 0;
+
+    pthread_mutex_lock(&pool->_lock);
+
+    while (wait && max > 0 && pool->_done_head == NULL && pool->_unpolled_cnt > 0)
     {
-        if (in_blk_offset + remaining_bytes_to_read <= 4096) /* last blk to read */
-        {
-            memcpy(buf + buf_offset, data_blk + in_blk_offset, remaining_bytes_to_read);
-            break;
-        }
-        else
-        {
-            int num_of_bytes_to_read_from_this_blk = 4096 - in_blk_offset;
+        pthread_cond_wait(&pool->_completed, &pool->_lock);
+    }
 
-            remaining_bytes_to_read -= num_of_bytes_to_read_from_this_blk;
-            memcpy(buf + buf_offset, data_blk + in_blk_offset, num_of_bytes_to_read_from_this_blk);
-            in_blk_offset = 0; /* for next blk, we will read from start */
-            buf_offset += num_of_bytes_to_read_from_this_blk;
-            data_blk_idx = find_idx_of_next_data_blk(data_blk_idx);
-            assert(block_read(_superblock._data_blk_strt_idx + data_blk_idx, (void *)data_blk) == 0); /* update data blk */
-        }
+    while (cnt < max && pool->_done_head != NULL)
+    {
+        reqs[cnt++] = pool->_done_head;
+        pool->_done_head = pool->_done_head->next;
     }
 
-    _fd_table[fd]._offset += count; /* increment fd offset by the amount we read */
+    pool->_done_tail = pool->_done_head == NULL ? NULL : pool->_done_tail;
+    pool->_unpolled_cnt -= cnt;
+    pthread_mutex_unlock(&pool->_lock);
 
-    return count;
+    return cnt;
 }
 
 uint16_t find_idx_of_next_data_blk(uint16_t cur_data_blk_idx)
@@ -571,90 +1612,311 @@ uint16_t find_idx_of_next_data_blk(uint16_t cur_data_blk_idx)
     int fat_blk_idx = cur_data_blk_idx / 2048;
     int fat_entry_idx = cur_data_blk_idx % 2048;
 
-    return _fat_section[fat_blk_idx]._entry[fat_entry_idx];
+    return _fs->_fat_section[fat_blk_idx]._entry[fat_entry_idx];
 }
 
-uint16_t find_first_data_blk_idx_of_a_file(const char *filename)
+int find_root_entry_idx(const char *filename)
 {
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    for (int i = _fs->_root_hash_bucket[root_hash(filename)]; i >= 0; i = _fs->_root_hash_next[i])
     {
-        bool root_entry_is_valid = _rootdirectory._entrys[i]._first_data_blk_idx != 0;
-
-        if (root_entry_is_valid && strcmp(filename, (const char *)_rootdirectory._entrys[i]._filename) == 0)
+        if (strcmp(filename, (const char *)_fs->_rootdirectory._entrys[i]._filename) == 0)
         {
-            return _rootdirectory._entrys[i]._first_data_blk_idx;
+            return i;
         }
     }
 
-    return 1000;
+    return -1;
 }
 
-bool filename_already_exists_in_root(const char *filename)
+uint32_t root_hash(const char *filename)
 {
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    uint32_t hash = 2166136261u; /* FNV-1a */
+
+    for (int i = 0; i < FS_FILENAME_LEN && filename[i] != '\0'; i++)
     {
-        bool root_entry_is_valid = _rootdirectory._entrys[i]._first_data_blk_idx != 0;
+        hash = (hash ^ (uint8_t)filename[i]) * 16777619u;
+    }
+
+    return hash % ROOT_HASH_BUCKET_CNT;
+}
+
+void root_hash_insert(int root_entry_idx)
+{
+    uint32_t bucket = root_hash((const char *)_fs->_rootdirectory._entrys[root_entry_idx]._filename);
+
+    _fs->_root_hash_next[root_entry_idx] = _fs->_root_hash_bucket[bucket];
+    _fs->_root_hash_bucket[bucket] = root_entry_idx;
+}
+
+void root_hash_remove(int root_entry_idx)
+{
+    int *link = &_fs->_root_hash_bucket[root_hash((const char *)_fs->_rootdirectory._entrys[root_entry_idx]._filename)];
 
-        if (root_entry_is_valid && strcmp(filename, (const char *)_rootdirectory._entrys[i]._filename) == 0)
+    /* unlink the entry from its bucket chain */
+    while (*link >= 0)
+    {
+        if (*link == root_entry_idx)
         {
-            return true;
+            *link = _fs->_root_hash_next[root_entry_idx];
+            _fs->_root_hash_next[root_entry_idx] = -1;
+            return;
         }
+
+        link = &_fs->_root_hash_next[*link];
     }
+}
 
-    return false;
+void root_hash_build()
+{
+    memset(_fs->_root_hash_bucket, -1, sizeof(_fs->_root_hash_bucket));
+    memset(_fs->_root_hash_next, -1, sizeof(_fs->_root_hash_next));
+
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    {
+        if (_fs->_rootdirectory._entrys[i]._first_data_blk_idx != 0)
+        {
+            root_hash_insert(i);
+        }
+    }
+}
+
+uint16_t find_first_data_blk_idx_of_a_file(const char *filename)
+{
+    int i = find_root_entry_idx(filename);
+
+    if (i < 0)
+    {
+        return 1000;
+    }
+
+    return _fs->_rootdirectory._entrys[i]._first_data_blk_idx;
+}
+
+bool filename_already_exists_in_root(const char *filename)
+{
+    return find_root_entry_idx(filename) >= 0;
 }
 
 bool fs_mount_read_fat_section()
 {
-    _fat_section = malloc(_superblock._total_FAT_blk_cnt * sizeof(fatblock));
+    _fs->_fat_section = malloc(_fs->_superblock._total_FAT_blk_cnt * sizeof(fatblock));
+    _fs->_fat_blk_dirty = calloc(_fs->_superblock._total_FAT_blk_cnt, sizeof(bool));
+
+    if (_fs->_fat_section == NULL || _fs->_fat_blk_dirty == NULL)
+    {
+        fs_mount_free_fat_section();
+        return false;
+    }
 
-    for (int i = 0; i < _superblock._total_FAT_blk_cnt; i++)
+    for (int i = 0; i < _fs->_superblock._total_FAT_blk_cnt; i++)
     {
-        if (block_read(_fat_block_strt_idx + i, (void *)&_fat_section[i]) != 0)
+        if (block_read(_fat_block_strt_idx + i, (void *)&_fs->_fat_section[i]) != 0)
         {
+            fs_mount_free_fat_section();
             return false;
         }
     }
 
-    if (_fat_section[0]._entry[0] != FAT_EOC) /* check if first entry of FAT is unused */
+    if (_fs->_fat_section[0]._entry[0] != FAT_EOC) /* check if first entry of FAT is unused */
     {
+        fs_mount_free_fat_section();
         return false;
     }
 
-    set_free_FAT_entry_cnt();
+    if (!free_space_index_build())
+    {
+        fs_mount_free_fat_section();
+        return false;
+    }
 
     return true;
 }
 
-void set_free_FAT_entry_cnt()
+void fs_mount_free_fat_section()
 {
-    int cnt = 0;
-    bool quit = false;
+    free(_fs->_fat_section);
+    free(_fs->_fat_blk_dirty);
+    _fs->_fat_section = NULL;
+    _fs->_fat_blk_dirty = NULL;
+}
+
+bool free_space_index_build()
+{
+    int data_blk_cnt = _fs->_superblock._total_data_blk_cnt;
+
+    _fs->_free_blk_bitmap_word_cnt = (data_blk_cnt + 63) / 64;
+    _fs->_free_blk_summary_word_cnt = (_fs->_free_blk_bitmap_word_cnt + 63) / 64;
+    _fs->_free_blk_bitmap = calloc(_fs->_free_blk_bitmap_word_cnt, sizeof(uint64_t));
+    _fs->_free_blk_summary = calloc(_fs->_free_blk_summary_word_cnt, sizeof(uint64_t));
+    _fs->_free_FAT_entry_cnt = 0;
+
+    if (_fs->_free_blk_bitmap == NULL || _fs->_free_blk_summary == NULL)
+    {
+        free_space_index_free();
+        return false;
+    }
 
-    for (int i = 0; i < _superblock._total_FAT_blk_cnt; i++)
+    /* this is the only full scan of the fat, allocations and deletes update the index in place */
+    for (int i = 0; i < data_blk_cnt; i++)
     {
-        for (int j = 0; j < _num_of_fat_entries_per_block; j++)
+        if (_fs->_fat_section[i / 2048]._entry[i % 2048] == 0) /* 0 corresponds to free data block */
         {
-            /* check for out of bound */
-            if (i * _num_of_fat_entries_per_block + j + 1 > _superblock._total_data_blk_cnt)
-            {
-                quit = true;
-                break;
-            }
+            free_space_index_mark_free(i);
+        }
+    }
 
-            if (_fat_section[i]._entry[j] == 0) /* 0 corresponds to free data block */
-            {
-                cnt++;
-            }
+    return true;
+}
+
+void free_space_index_free()
+{
+    free(_fs->_free_blk_bitmap);
+    free(_fs->_free_blk_summary);
+    _fs->_free_blk_bitmap = _fs->_free_blk_summary = NULL;
+    _fs->_free_blk_bitmap_word_cnt = _fs->_free_blk_summary_word_cnt = 0;
+    _fs->_next_fit_cursor = 0;
+}
+
+int free_space_index_next_free(int data_blk_idx)
+{
+    int data_blk_cnt = _fs->_superblock._total_data_blk_cnt;
+
+    while (data_blk_idx < data_blk_cnt)
+    {
+        int word_idx = data_blk_idx / 64;
+
+        if (_fs->_free_blk_summary[word_idx / 64] >> (word_idx % 64) == 0)
+        {
+            /* nothing free in the rest of this summary word, skip 4096 blocks at once */
+            data_blk_idx = (word_idx / 64 + 1) * 64 * 64;
+            continue;
+        }
+
+        uint64_t word = _fs->_free_blk_bitmap[word_idx] >> (data_blk_idx % 64);
+
+        if (word != 0)
+        {
+            return data_blk_idx + __builtin_ctzll(word);
         }
 
-        if (quit)
+        data_blk_idx = (word_idx + 1) * 64;
+    }
+
+    return -1; /* no free data block at or after @data_blk_idx */
+}
+
+int free_space_index_run_len(int data_blk_idx, int max)
+{
+    int data_blk_cnt = _fs->_superblock._total_data_blk_cnt;
+    int len = 0;
+
+    while (len < max && data_blk_idx + len < data_blk_cnt)
+    {
+        int cur = data_blk_idx + len;
+        uint64_t used = ~_fs->_free_blk_bitmap[cur / 64] >> (cur % 64);
+
+        /* count the free bits up to the next used one in this word */
+        int free_bits = used == 0 ? 64 - cur % 64 : __builtin_ctzll(used);
+
+        if (free_bits == 0)
         {
             break;
         }
+
+        len += free_bits;
+    }
+
+    if (len > max)
+    {
+        len = max;
+    }
+
+    if (data_blk_idx + len > data_blk_cnt)
+    {
+        len = data_blk_cnt - data_blk_idx;
+    }
+
+    return len;
+}
+
+int free_space_index_find_best_fit(int num, int *run_len)
+{
+    int data_blk_cnt = _fs->_superblock._total_data_blk_cnt;
+    int best_strt_idx = -1, best_len = 0;
+    int largest_strt_idx = -1, largest_len = 0;
+    int scan_strt_idx = _fs->_next_fit_cursor;
+    int data_blk_idx = free_space_index_next_free(scan_strt_idx);
+    bool wrapped = false;
+
+    /* once around the disk from the next-fit cursor, so the nearest of equal runs wins, bounded on a fragmented disk */
+    for (int run_cnt = 0; run_cnt < BEST_FIT_MAX_RUN_CNT; run_cnt++)
+    {
+        if (data_blk_idx < 0 && !wrapped)
+        {
+            wrapped = true;
+            data_blk_idx = free_space_index_next_free(0);
+        }
+
+        if (data_blk_idx < 0 || (wrapped && data_blk_idx >= scan_strt_idx))
+        {
+            break; /* every free run has been looked at */
+        }
+
+        int len = free_space_index_run_len(data_blk_idx, data_blk_cnt);
+
+        if (len >= num && (best_strt_idx < 0 || len < best_len))
+        {
+            best_strt_idx = data_blk_idx;
+            best_len = len;
+        }
+
+        if (len > largest_len)
+        {
+            largest_strt_idx = data_blk_idx;
+            largest_len = len;
+        }
+
+        if (len == num)
+        {
+            break; /* exact fit, nothing can do better */
+        }
+
+        data_blk_idx = free_space_index_next_free(data_blk_idx + len);
+    }
+
+    if (best_strt_idx >= 0)
+    {
+        *run_len = num;
+        return best_strt_idx;
+    }
+
+    /* no run seen can hold @num blocks, take the largest one to keep the number of extents low */
+    *run_len = largest_len;
+    return largest_strt_idx;
+}
+
+void free_space_index_mark_used(uint16_t data_blk_idx)
+{
+    int word_idx = data_blk_idx / 64;
+
+    _fs->_free_blk_bitmap[word_idx] &= ~(1ULL << (data_blk_idx % 64));
+
+    if (_fs->_free_blk_bitmap[word_idx] == 0)
+    {
+        _fs->_free_blk_summary[word_idx / 64] &= ~(1ULL << (word_idx % 64));
     }
 
-    _free_FAT_entry_cnt = cnt;
+    _fs->_free_FAT_entry_cnt--;
+}
+
+void free_space_index_mark_free(uint16_t data_blk_idx)
+{
+    int word_idx = data_blk_idx / 64;
+
+    _fs->_free_blk_bitmap[word_idx] |= 1ULL << (data_blk_idx % 64);
+    _fs->_free_blk_summary[word_idx / 64] |= 1ULL << (word_idx % 64);
+
+    _fs->_free_FAT_entry_cnt++;
 }
 
 bool fs_mount_init(const char *diskname)
@@ -675,52 +1937,78 @@ bool fs_mount_init(const char *diskname)
         return false;
     }
 
-    /* init fd table */
+    if (!cache_init())
+    {
+        free_space_index_free(); /* undo fs_mount_read_fat_section(), the disk is closed by the caller */
+        fs_mount_free_fat_section();
+        return false;
+    }
+
+    /* init open file and fd tables */
+    memset(_fs->_open_files, 0, sizeof(_fs->_open_files));
+    pthread_mutex_init(&_fs->_dir_lock, NULL);
+    pthread_mutex_init(&_fs->_alloc_lock, NULL);
+    aio_pool_init();
+
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    {
+        pthread_rwlock_init(&_fs->_open_files[i]._lock, NULL);
+        pthread_mutex_init(&_fs->_open_files[i]._map_lock, NULL);
+    }
+
     for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
     {
-        _fd_table[i]._in_use = false;
-        _fd_table[i]._offset = 0;
+        _fs->_fd_table[i]._in_use = false;
+        _fs->_fd_table[i]._offset = 0;
+        reset_fd_cursor(i);
     }
 
-    _mounted = true;
+    _fs->_mounted = true;
 
     return true;
 }
 
 bool fs_mount_read_root_directory_block()
 {
-    memset(&_rootdirectory, 0, sizeof(rootdirectory));
+    memset(&_fs->_rootdirectory, 0, sizeof(rootdirectory));
 
-    if (block_read(_superblock._root_blk_strt_idx,
-                   (void *)&_rootdirectory) != 0)
+    if (block_read(_fs->_superblock._root_blk_strt_idx,
+                   (void *)&_fs->_rootdirectory) != 0)
     {
         return false;
     }
 
     set_free_root_entry_cnt();
+    root_hash_build();
 
     return true;
 }
 
 bool fs_mount_read_superblock()
 {
-    memset(&_superblock, 0, sizeof(superblock));
+    memset(&_fs->_superblock, 0, sizeof(superblock));
 
     /* read superblock */
 
-    if (block_read(0, (void *)&_superblock) != 0)
+    if (block_read(0, (void *)&_fs->_superblock) != 0)
     {
         return false;
     }
 
     /* verify superblock */
 
-    if (strncmp((const char *)_superblock._signature, _signature, 8) != 0)
+    if (strncmp((const char *)_fs->_superblock._signature, _signature, 8) != 0)
     {
         return false;
     }
 
-    if (block_disk_count() != _superblock._total_blk_cnt)
+    if (block_disk_count() != _fs->_superblock._total_blk_cnt)
+    {
+        return false;
+    }
+
+    /* let the disk layer tell superblock, fat, root and data traffic apart */
+    if (block_set_layout(_fs->_superblock._root_blk_strt_idx, _fs->_superblock._data_blk_strt_idx) != 0)
     {
         return false;
     }
@@ -728,6 +2016,52 @@ bool fs_mount_read_superblock()
     return true;
 }
 
+bool fs_format_ram_disk(size_t data_blk_cnt)
+{
+    size_t fat_blk_cnt = (data_blk_cnt * 2 + 4095) / 4096;
+    superblock sb;
+    fatblock fat;
+    rootdirectory root;
+
+    if (data_blk_cnt == 0 || 2 + fat_blk_cnt + data_blk_cnt > UINT16_MAX)
+    {
+        return false; /* block indices are 16 bit wide */
+    }
+
+    if (block_disk_open_ram(2 + fat_blk_cnt + data_blk_cnt) != 0)
+    {
+        return false;
+    }
+
+    /* same layout as fs_make.x: superblock, fat, root directory, data */
+    memset(&sb, 0, sizeof(superblock));
+    memcpy(sb._signature, _signature, 8);
+    sb._total_blk_cnt = 2 + fat_blk_cnt + data_blk_cnt;
+    sb._root_blk_strt_idx = 1 + fat_blk_cnt;
+    sb._data_blk_strt_idx = 2 + fat_blk_cnt;
+    sb._total_data_blk_cnt = data_blk_cnt;
+    sb._total_FAT_blk_cnt = fat_blk_cnt;
+
+    memset(&fat, 0, sizeof(fatblock));
+    fat._entry[0] = FAT_EOC; /* data block 0 is never handed out */
+    memset(&root, 0, sizeof(rootdirectory));
+
+    bool formatted = block_write(0, (void *)&sb) == 0 && block_write(sb._root_blk_strt_idx, (void *)&root) == 0;
+
+    for (size_t i = 0; i < fat_blk_cnt && formatted; i++)
+    {
+        formatted = block_write(_fat_block_strt_idx + i, (void *)&fat) == 0;
+        fat._entry[0] = 0;
+    }
+
+    if (!formatted)
+    {
+        block_disk_close();
+    }
+
+    return formatted;
+}
+
 int fat_ceil(int file_size_in_bytes)
 {
     /* e.g. 8193 => 4096*3 = 12288, 12 => 4096 */
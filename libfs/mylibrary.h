@@ -4,13 +4,30 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <sys/uio.h>
 #include "fs.h"
 
+typedef struct extentmap extentmap;
+typedef struct openfile openfile;
+typedef struct iobatch iobatch;
+typedef struct fs_context fs_context;
+typedef struct iovcursor iovcursor;
+
 /************************* GENERAL METHODS ********************************/
 
 bool fs_mount_init(const char *diskname);
 bool fs_is_mounted();
 void fs_unmount_procedure();
+fs_context *fs_default_context(); /* instance behind the fs_* calls without a context */
+fs_context *fs_context_new();     /* unmounted instance with a disk instance of its own */
+void fs_context_free(fs_context *ctx);
+bool fs_use(fs_context *ctx); /* make ctx, its disk and its cache the ones of the calling thread, false if NULL */
+void fs_lock_dir();              /* root directory, open file and fd tables */
+void fs_unlock_dir();
+void fs_lock_alloc();            /* fat and free space index, never held while taking the dir lock */
+void fs_unlock_alloc();
+void file_lock(int fd, bool exclusive); /* file bound to fd, exclusive for writers */
+void file_unlock(int fd);
 void fs_print_info();
 void fs_print_ls();
 void delete_file(const char *filename); /* delete file on fat and root block */
@@ -23,33 +40,96 @@ bool filename_already_exists_in_root(const char *filename);
 void create_new_file_on_root(const char *filename);
 int find_file_size(int fd);
 void update_file_size(int fd, uint32_t size);
+int find_root_entry_idx(const char *filename); /* -1 if there is no such file */
+uint32_t root_hash(const char *filename);
+void root_hash_insert(int root_entry_idx);
+void root_hash_remove(int root_entry_idx);
+void root_hash_build();
 uint16_t find_first_data_blk_idx_of_a_file(const char *filename);
 void update_idx_of_1st_data_blk_in_root(int fd, uint16_t idx);
 
 /************************* SUPER BLOCK ********************************/
 
 bool fs_mount_read_superblock();
+bool fs_format_ram_disk(size_t data_blk_cnt); /* open a ram disk holding an empty file system, false if too large */
 
 /************************* FAT BLOCK ********************************/
 
-void set_free_FAT_entry_cnt();
 bool fs_mount_read_fat_section();
-uint16_t find_data_blk_idx_by_offset(int fd);
+void fs_mount_free_fat_section(); /* free what fs_mount_read_fat_section() allocated */
+uint16_t find_data_blk_idx_by_offset(int fd, size_t offset, bool use_cursor);
 uint16_t find_idx_of_next_data_blk(uint16_t cur_data_blk_idx);
-void fat_allocate_extra_entry(int num, int *actual_amount_allocated, uint16_t *idx_of_1st_new_entry);
+void fat_allocate_extra_entry(int num, uint16_t tail_data_blk_idx, int *actual_amount_allocated, uint16_t *idx_of_1st_new_entry, uint16_t *idx_of_last_new_entry);
+void fat_allocate_run(int run_strt_idx, int run_len, int *prev_data_blk_idx, int *actual_amount_allocated, uint16_t *idx_of_1st_new_entry);
 void update_last_fat_entry_of_a_file(int fd, uint16_t new_entry);
+uint16_t find_tail_data_blk_idx_of_a_file(openfile *file);
+void fat_set_entry(uint16_t data_blk_idx, uint16_t value); /* modify an entry and mark its fat block dirty */
+int fat_flush_dirty_blocks();                                /* write back dirty fat blocks, return how many */
+
+/************************* FREE SPACE INDEX ********************************/
+
+bool free_space_index_build(); /* false if the index cannot be allocated */
+void free_space_index_free();
+int free_space_index_next_free(int data_blk_idx);
+int free_space_index_run_len(int data_blk_idx, int max);
+int free_space_index_find_best_fit(int num, int *run_len);
+void free_space_index_mark_used(uint16_t data_blk_idx);
+void free_space_index_mark_free(uint16_t data_blk_idx);
+
+/************************* EXTENT MAP ********************************/
+
+extentmap *get_extent_map(openfile *file);
+void extent_map_append_chain(extentmap *map, int logical_blk_idx, uint16_t data_blk_idx, int num);
+uint16_t extent_map_lookup(extentmap *map, int logical_blk_idx);
+void extent_map_free(extentmap *map);
+int find_extent_cnt(int fd); /* runs of contiguous data blocks of the file bound to fd */
 
 /************************* FILE DESCRIPTOR TABLE ********************************/
 int get_new_fd(const char *filename);
+openfile *open_file_get(int root_entry_idx); /* bind a new fd to the file, loading it on first open */
+void open_file_put(openfile *file);
 bool fd_is_in_use(int fd);
 bool file_is_open(const char *filename);
 void close_fd(int fd);
+size_t get_fd_offset(int fd);
 void change_fd_offset(int fd, size_t offset);
+void reset_fd_cursor(int fd);
+void reset_fd_readahead(int fd);
+void fd_readahead(int fd, bool sequential, int ra_missed_blk_cnt); /* adapt the window and prefetch after a read */
+void set_fd_cursor(int fd, int logical_blk_idx, uint16_t data_blk_idx);
 
 /************************* FS_READ_AND_WRITE ***************************/
 
-int fs_read_impl(int fd, void *buf, size_t count);
-int fs_write_impl(int fd, void *buf, size_t count);
+/* at offset, and if move_offset from the fd offset, which is then advanced along with the cursor and read ahead */
+int fs_read_impl(int fd, const struct iovec *bufs, int bufcnt, size_t offset, bool move_offset);
+int fs_write_impl(int fd, const struct iovec *bufs, int bufcnt, size_t offset, bool move_offset);
+
+/************************* ASYNC I/O BATCH ***************************/
+
+struct iovec *iobatch_next_iov(iobatch *batch);                          /* buffers of the next request to fill */
+void iobatch_submit(iobatch *batch, size_t blk_idx, int iovcnt, bool write); /* start it, drain the batch if full */
+void iobatch_wait(iobatch *batch);                                       /* wait for every request of the batch */
+
+/************************* ASYNC FILE I/O ***************************/
+
+void aio_pool_init();
+void aio_pool_destroy();
+bool aio_pool_start(); /* spawn the workers, called with the pool lock held on the first request */
+void aio_pool_stop();  /* wait for every request in flight and join the workers */
+void *aio_pool_worker(void *arg);
+bool aio_pool_submit(struct fs_aio *req); /* queue req for a worker, false if none could be started */
+int aio_pool_poll(struct fs_aio **reqs, int max, bool wait);
+
+/************************* SCATTER/GATHER LIST ***************************/
+
+size_t iov_total_len(const struct iovec *iov, int iovcnt);
+void iov_cursor_init(iovcursor *cur, const struct iovec *iov, int iovcnt);
+void iov_cursor_seek(iovcursor *cur, size_t pos); /* find the buffer holding byte pos of the stream */
+int iov_walk(iovcursor *cur, size_t pos, size_t len, uint8_t *data, bool to_iov, struct iovec *dst, int *dstcnt);
+int iov_piece_cnt(iovcursor *cur, size_t pos, size_t len); /* number of buffers [pos, pos + len) spans */
+void iov_gather(iovcursor *cur, size_t pos, uint8_t *data, size_t len);
+void iov_scatter(iovcursor *cur, size_t pos, const uint8_t *data, size_t len);
+void iov_append(iovcursor *cur, size_t pos, size_t len, struct iovec *dst, int *dstcnt); /* merged with dst's last buffer if contiguous */
 
 /************************* HELPER METHODS ***************************/
 bool is_filename_valid(const char *filename);
@@ -3,14 +3,17 @@
 #include <stdint.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <disk.h>
 #include <fs.h>
 
 /* Comprehensive tests for fs_150 */
@@ -21,6 +24,94 @@ void usage()
     exit(1);
 }
 
+void aio_done(struct fs_aio *req)
+{
+    __atomic_store_n((int *)req->data, req->result, __ATOMIC_RELEASE); /* called from a worker thread */
+}
+
+/* mount a ram disk with a cache of the given number of blocks, whatever LIBFS_CACHE_BLOCKS holds */
+int mount_ram_with_cache(size_t data_blk_cnt, const char *cache_blk_cnt)
+{
+    char *saved = getenv("LIBFS_CACHE_BLOCKS");
+    int ret;
+
+    saved = saved ? strdup(saved) : NULL;
+    setenv("LIBFS_CACHE_BLOCKS", cache_blk_cnt, 1);
+    ret = fs_mount_ram(data_blk_cnt);
+    if (saved)
+    {
+        setenv("LIBFS_CACHE_BLOCKS", saved, 1);
+        free(saved);
+    }
+    else
+    {
+        unsetenv("LIBFS_CACHE_BLOCKS");
+    }
+    return ret;
+}
+
+struct pio_arg
+{
+    int fd;
+    const uint8_t *data; /* expected content of the file */
+    unsigned int seed;
+    int write;           /* write the expected content back rather than read it */
+};
+
+/* positional I/O at pseudo-random offsets within the first 64 blocks of the file */
+void *pio_thread(void *arg)
+{
+    struct pio_arg *pio = arg;
+    uint8_t buf[1000];
+
+    for (int i = 0; i < 200; i++)
+    {
+        size_t offset = rand_r(&pio->seed) % (64 * 4096 - sizeof(buf));
+
+        if (pio->write)
+        {
+            assert(fs_pwrite(pio->fd, (void *)(pio->data + offset), sizeof(buf), offset) == sizeof(buf));
+        }
+        else
+        {
+            assert(fs_pread(pio->fd, (void *)buf, sizeof(buf), offset) == sizeof(buf));
+            assert(memcmp(buf, pio->data + offset, sizeof(buf)) == 0);
+        }
+    }
+    return NULL;
+}
+
+/* microseconds taken by @cnt block reads on a ram disk throttled by the environment variable @name set to @val */
+long long throttled_reads_us(const char *name, const char *val, int cnt)
+{
+    struct timespec start, end;
+    uint8_t blk[4096];
+
+    setenv(name, val, 1);
+    assert(block_disk_open_ram(cnt) == 0);
+    unsetenv(name);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < cnt; i++)
+    {
+        assert(block_read(i, blk) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert(block_disk_close() == 0);
+
+    return (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+/* data block reads since the mount: all of them, and those issued on demand rather than read ahead */
+void data_reads(unsigned long long *reads, unsigned long long *sync_reads)
+{
+    struct block_stats io;
+    struct fs_cache_stats stats;
+
+    assert(block_stats_snapshot(&io) == 0 && fs_cache_stats(&stats) == 0);
+    *reads = io.cat[BLOCK_CAT_DATA].reads;
+    *sync_reads = *reads - stats.prefetches;
+}
+
 int main(int argc, char **argv)
 {
     char *diskname;
@@ -97,6 +188,68 @@ int main(int argc, char **argv)
     assert(fs_read(fd3, (void *)read_buf, 100) == 8);
     assert(memcmp(read_buf, MSG + 12, 8) == 0);
 
+    /* test fs_pread and fs_pwrite, the fd offset stays at 20 */
+    assert(fs_pread(100, (void *)read_buf, 5, 0) == -1 && fs_pwrite(100, (void *)msg, 5, 0) == -1);
+    assert(fs_pread(fd3, (void *)read_buf, 5, 21) == -1); /* past the end of the file */
+    assert(fs_pread(fd3, (void *)read_buf, 5, 2) == 5);
+    assert(memcmp(read_buf, MSG + 2, 5) == 0);
+    assert(fs_pwrite(fd3, (void *)msg, 4, 18) == 4); /* file: ABCDEFGHIJKLMNOPQRabcd */
+    assert(fs_pwrite(fd3, (void *)msg, 4, 23) == -1);
+    assert(fs_stat(fd3) == 22);
+    assert(fs_pread(fd3, (void *)read_buf, 100, 16) == 6);
+    assert(memcmp(read_buf, "QRabcd", 6) == 0);
+    assert(fs_read(fd3, (void *)read_buf, 100) == 2);
+    assert(memcmp(read_buf, "cd", 2) == 0);
+
+    /* test fs_writev and fs_readv, the buffers are filled in order */
+    struct iovec iov[3] = {{MSG, 3}, {msg, 0}, {msg + 10, 4}};
+    assert(fs_writev(100, iov, 3) == -1 && fs_readv(fd3, NULL, 1) == -1 && fs_readv(fd3, iov, -1) == -1);
+    assert(fs_lseek(fd3, 20) == 0);
+    assert(fs_writev(fd3, iov, 3) == 7); /* file: ABCDEFGHIJKLMNOPQRabABCklmn */
+    assert(fs_stat(fd3) == 27);
+    uint8_t head[2], tail[20];
+    struct iovec read_iov[2] = {{head, 2}, {tail, 20}};
+    assert(fs_lseek(fd3, 17) == 0);
+    assert(fs_readv(fd3, read_iov, 2) == 10);
+    assert(memcmp(head, "Ra", 2) == 0 && memcmp(tail, "bABCklmn", 8) == 0);
+
+    /* test fs_aio_write, fs_aio_read and fs_aio_poll, the fd offset stays at 27 */
+    struct fs_aio aio_write = {.fd = 100, .buf = msg, .count = 5, .offset = 0};
+    struct fs_aio aio_read = {.fd = fd3, .buf = read_buf, .count = 100, .offset = 20};
+    struct fs_aio *done[2];
+    assert(fs_aio_read(NULL) == -1 && fs_aio_write(&aio_write) == -1);
+    assert(fs_aio_poll(NULL, 2, 1) == -1 && fs_aio_poll(done, -1, 1) == -1);
+    assert(fs_aio_poll(done, 2, 1) == 0); /* nothing in flight */
+    aio_write.fd = fd3;
+    assert(fs_aio_write(&aio_write) == 0); /* file: abcdeFGHIJKLMNOPQRabABCklmn */
+    assert(fs_aio_poll(done, 2, 1) == 1 && done[0] == &aio_write && aio_write.result == 5);
+    assert(fs_aio_read(&aio_read) == 0);
+    assert(fs_aio_poll(done, 2, 1) == 1 && done[0] == &aio_read && aio_read.result == 7);
+    assert(memcmp(read_buf, "ABCklmn", 7) == 0);
+    aio_read.offset = 28;
+    assert(fs_aio_read(&aio_read) == 0);
+    assert(fs_aio_poll(done, 2, 1) == 1 && aio_read.result == -1); /* past the end of the file */
+    assert(fs_pread(fd3, (void *)read_buf, 6, 0) == 6 && memcmp(read_buf, "abcdeF", 6) == 0);
+    assert(fs_stat(fd3) == 27 && fs_read(fd3, (void *)read_buf, 10) == 0);
+
+    /* test fs_sync, fs_cache_stats */
+    struct fs_cache_stats stats;
+    assert(fs_cache_stats(NULL) == -1);
+    assert(fs_cache_stats(&stats) == 0);
+    assert(stats.capacity == 0 || stats.hits > 0); /* the blocks just written are cached */
+    assert(fs_sync() == 0);
+
+    /* test fat write back, only the fat blocks an operation modifies are written */
+    struct block_stats io_before, io_after;
+    uint8_t blk[4096] = {0};
+    assert(block_stats_snapshot(&io_before) == 0);
+    assert(fs_pwrite(fd3, (void *)blk, 27, 0) == 27); /* no new block, the fat is left alone */
+    assert(block_stats_snapshot(&io_after) == 0);
+    assert(io_after.cat[BLOCK_CAT_FAT].bytes_written == io_before.cat[BLOCK_CAT_FAT].bytes_written);
+    assert(fs_pwrite(fd3, (void *)blk, 4096, 27) == 4096); /* one new block, one fat block written */
+    assert(block_stats_snapshot(&io_after) == 0);
+    assert(io_after.cat[BLOCK_CAT_FAT].bytes_written == io_before.cat[BLOCK_CAT_FAT].bytes_written + 4096);
+
     /* test fs_delete and fs_close, fs_ls, fs_unmount, fs_info */
     assert(fs_delete("file") == -1); /* currently open */
     assert(fs_close(fd0) == 0 && fs_close(fd1) == 0 && fs_close(fd2) == 0 && fs_close(fd3) == 0 && fs_close(100) == -1);
@@ -107,4 +260,257 @@ int main(int argc, char **argv)
     assert(fs_umount() == -1); /* no underlying disk is open */
     assert(fs_ls() == -1);     /* no underlying disk is open */
     assert(fs_info() == -1);   /* no underlying disk is open */
+    assert(fs_sync() == -1);   /* no underlying disk is open */
+    assert(fs_cache_stats(&stats) == -1);
+
+    /* test fs_mount_ram, the file system is gone once unmounted */
+    struct fs_context *ctx;
+    assert(fs_mount_ram(0) == -1 && fs_mount_ram(65535) == -1); /* does not fit 16-bit block indices */
+    assert(fs_mount_ram(1000) == 0 && fs_mount_ram(1000) == -1);
+    assert(fs_create("ramfile") == 0 && (fd0 = fs_open("ramfile")) >= 0);
+    assert(fs_write(fd0, (void *)MSG, 20) == 20 && fs_pread(fd0, (void *)read_buf, 20, 0) == 20);
+    assert(memcmp(read_buf, MSG, 20) == 0);
+    assert(fs_close(fd0) == 0 && fs_umount() == 0);
+    assert(fs_mount_ram(1000) == 0 && fs_open("ramfile") == -1 && fs_umount() == 0);
+    assert((ctx = fs_mount_ram_ctx(1000)) != NULL && fs_create_ctx(ctx, "ramfile") == 0);
+    assert(fs_ls() == -1 && fs_umount_ctx(ctx) == 0);
+
+    /* test read ahead, sequential fs_read calls grow a window that fs_lseek resets, fs_pread reads on demand */
+    static uint8_t file_data[(1 << 20) + 2 * 4096];
+    uint8_t chunk[512];
+    unsigned long long reads, sync_reads, reads_before, sync_reads_before;
+    for (size_t i = 0; i < sizeof(file_data); i++)
+    {
+        file_data[i] = i % 251;
+    }
+    assert(mount_ram_with_cache(1000, "256") == 0);
+    assert(fs_create("rafile") == 0 && (fd0 = fs_open("rafile")) >= 0);
+    assert(fs_write(fd0, (void *)file_data, sizeof(file_data)) == sizeof(file_data)); /* too large to be cached */
+    data_reads(&reads_before, &sync_reads_before);
+    for (int offset = 0; offset < 8 * 4096; offset += 512)
+    {
+        assert(fs_pread(fd0, (void *)chunk, 512, offset) == 512 && memcmp(chunk, file_data + offset, 512) == 0);
+    }
+    data_reads(&reads, &sync_reads);
+    assert(reads - reads_before == 8 && sync_reads - sync_reads_before == 8); /* one miss per block */
+    assert(fs_lseek(fd0, 8 * 4096) == 0);
+    data_reads(&reads_before, &sync_reads_before);
+    for (int i = 0, offset = 8 * 4096; i < 64; i++, offset += 512)
+    {
+        assert(fs_read(fd0, (void *)chunk, 512) == 512 && memcmp(chunk, file_data + offset, 512) == 0);
+        data_reads(&reads, &sync_reads);
+        if (i == 1)
+        {
+            assert(reads - reads_before == 1 + 4); /* the second sequential call reads 4 blocks ahead */
+        }
+        if (i == 2)
+        {
+            assert(reads - reads_before == 1 + 4 + 4); /* the window doubles to 8, only the blocks past the first one are read */
+        }
+    }
+    assert(sync_reads - sync_reads_before == 1); /* the other 7 blocks were read ahead */
+    assert(fs_lseek(fd0, 100 * 4096) == 0);      /* past the window */
+    data_reads(&reads_before, &sync_reads_before);
+    assert(fs_read(fd0, (void *)chunk, 512) == 512 && memcmp(chunk, file_data + 100 * 4096, 512) == 0);
+    data_reads(&reads, &sync_reads);
+    assert(reads - reads_before == 1); /* not sequential, nothing read ahead */
+    assert(fs_read(fd0, (void *)chunk, 512) == 512 && memcmp(chunk, file_data + 100 * 4096 + 512, 512) == 0);
+    data_reads(&reads, &sync_reads);
+    assert(reads - reads_before == 1 + 4); /* the window starts over */
+    assert(fs_close(fd0) == 0 && fs_umount() == 0);
+
+    /* test fs_extent_count, a file grows in place or in a run large enough while another file grows next to it */
+    assert(fs_mount_ram(1000) == 0 && fs_extent_count(0) == -1);
+    assert(fs_create("hole") == 0 && (fd2 = fs_open("hole")) >= 0 && fs_write(fd2, (void *)file_data, 2 * 4096) == 2 * 4096);
+    assert(fs_create("grow1") == 0 && (fd1 = fs_open("grow1")) >= 0 && fs_write(fd1, (void *)file_data, 4096) == 4096);
+    assert(fs_close(fd2) == 0 && fs_delete("hole") == 0); /* 2 free blocks before grow1 */
+    assert(fs_create("grow0") == 0 && (fd0 = fs_open("grow0")) >= 0);
+    assert(fs_extent_count(fd0) == 0); /* empty */
+    assert(fs_write(fd0, (void *)file_data, 8 * 4096) == 8 * 4096 && fs_extent_count(fd0) == 1); /* not split over the hole */
+    assert(fs_write(fd0, (void *)file_data, 4 * 4096) == 4 * 4096 && fs_extent_count(fd0) == 1);
+    assert(fs_write(fd1, (void *)file_data, 4096) == 4096 && fs_extent_count(fd1) == 2); /* the hole is reused */
+    assert(fs_write(fd0, (void *)file_data, 4 * 4096) == 4 * 4096 && fs_extent_count(fd0) == 1);
+    assert(fs_close(fd0) == 0 && fs_close(fd1) == 0 && fs_umount() == 0);
+
+    /* test large reads, 1 MiB of a contiguous file is read in one request whether the cache is on or off */
+    const char *cache_blk_cnts[2] = {"256", "0"};
+    static uint8_t read_data[1 << 20];
+    for (int i = 0; i < 2; i++)
+    {
+        assert(mount_ram_with_cache(300, cache_blk_cnts[i]) == 0);
+        assert(fs_create("large") == 0 && (fd0 = fs_open("large")) >= 0);
+        assert(fs_write(fd0, (void *)file_data, sizeof(file_data)) == sizeof(file_data));
+        data_reads(&reads_before, &sync_reads_before);
+        assert(fs_pread(fd0, (void *)read_data, 1 << 20, 0) == 1 << 20 && memcmp(read_data, file_data, 1 << 20) == 0);
+        data_reads(&reads, &sync_reads);
+        assert(reads - reads_before == 1);
+        assert(fs_pread(fd0, (void *)read_data, 1 << 20, 100) == 1 << 20 && memcmp(read_data, file_data + 100, 1 << 20) == 0);
+        data_reads(&reads, &sync_reads);
+        assert(reads - reads_before == 1 + 1); /* the partial head and tail blocks are staged within the same request */
+        assert(fs_close(fd0) == 0 && fs_umount() == 0);
+    }
+
+    /* test the fd cursor, reads after an fs_lseek backwards do not resume from the cursor */
+    assert(fs_mount_ram(1000) == 0 && fs_create("cursor") == 0 && (fd0 = fs_open("cursor")) >= 0);
+    assert(fs_write(fd0, (void *)file_data, 8 * 4096) == 8 * 4096 && fs_lseek(fd0, 0) == 0);
+    for (int offset = 0; offset < 5 * 4096; offset += 512)
+    {
+        assert(fs_read(fd0, (void *)chunk, 512) == 512 && memcmp(chunk, file_data + offset, 512) == 0);
+    }
+    assert(fs_lseek(fd0, 4096 + 100) == 0); /* back 4 blocks */
+    assert(fs_read(fd0, (void *)chunk, 512) == 512 && memcmp(chunk, file_data + 4096 + 100, 512) == 0);
+    assert(fs_lseek(fd0, 4096 + 50) == 0); /* back within the cursor block */
+    assert(fs_read(fd0, (void *)chunk, 512) == 512 && memcmp(chunk, file_data + 4096 + 50, 512) == 0);
+    assert(fs_lseek(fd0, 0) == 0);
+    assert(fs_read(fd0, (void *)chunk, 512) == 512 && memcmp(chunk, file_data, 512) == 0);
+    assert(fs_read(fd0, (void *)chunk, 512) == 512 && memcmp(chunk, file_data + 512, 512) == 0);
+    assert(fs_close(fd0) == 0 && fs_umount() == 0);
+
+    /* test the extent map, positional reads find the blocks appended after it was built */
+    assert(fs_mount_ram(1000) == 0 && fs_create("map") == 0 && (fd0 = fs_open("map")) >= 0);
+    assert(fs_write(fd0, (void *)file_data, 2 * 4096) == 2 * 4096);
+    assert(fs_create("other") == 0 && (fd1 = fs_open("other")) >= 0 && fs_write(fd1, (void *)file_data, 4096) == 4096);
+    assert(fs_pread(fd0, (void *)chunk, 512, 4096) == 512 && memcmp(chunk, file_data + 4096, 512) == 0); /* built */
+    assert(fs_write(fd0, (void *)(file_data + 2 * 4096), 3 * 4096) == 3 * 4096 && fs_extent_count(fd0) == 2);
+    for (int offset = 4 * 4096 + 100; offset >= 0; offset -= 4096)
+    {
+        assert(fs_pread(fd0, (void *)chunk, 512, offset) == 512 && memcmp(chunk, file_data + offset, 512) == 0);
+    }
+    assert(fs_close(fd0) == 0 && fs_close(fd1) == 0 && fs_umount() == 0);
+
+    /* test appending, the tail shared by the fds of a file is kept up to date as its chain grows */
+    assert(fs_mount_ram(1000) == 0 && fs_create("tail") == 0 && fs_create("side") == 0);
+    assert((fd0 = fs_open("tail")) >= 0 && (fd1 = fs_open("tail")) >= 0 && (fd2 = fs_open("side")) >= 0);
+    for (int i = 0; i < 8; i++)
+    {
+        int fd = i % 2 ? fd1 : fd0;
+        assert(fs_lseek(fd, fs_stat(fd)) == 0 && fs_write(fd, (void *)(file_data + i * 3000), 3000) == 3000);
+        assert(fs_write(fd2, (void *)file_data, 4096) == 4096); /* the next append cannot grow in place */
+    }
+    assert(fs_close(fd0) == 0 && fs_close(fd1) == 0);
+    assert((fd0 = fs_open("tail")) >= 0 && fs_lseek(fd0, 8 * 3000) == 0); /* tail found again on first use */
+    assert(fs_write(fd0, (void *)(file_data + 8 * 3000), 3000) == 3000 && fs_stat(fd0) == 9 * 3000);
+    assert(fs_pread(fd0, (void *)read_data, 9 * 3000, 0) == 9 * 3000 && memcmp(read_data, file_data, 9 * 3000) == 0);
+    assert(fs_close(fd0) == 0 && fs_close(fd2) == 0 && fs_umount() == 0);
+
+    /* test root directory lookups, names stay found in the hash after entries are deleted and reused */
+    char name[16];
+    assert(fs_mount_ram(1000) == 0);
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    {
+        snprintf(name, sizeof(name), "f%d", i);
+        assert(fs_create(name) == 0);
+    }
+    assert(fs_create("extra") == -1); /* root directory is full */
+    assert(fs_delete("f5") == 0 && fs_open("f5") == -1);
+    assert(fs_create("f5") == 0 && (fd0 = fs_open("f5")) >= 0 && fs_stat(fd0) == 0 && fs_close(fd0) == 0);
+    assert(fs_delete("f64") == 0 && fs_create("g64") == 0); /* entry reused under another name */
+    assert(fs_open("f64") == -1 && fs_create("f64") == -1);
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    {
+        snprintf(name, sizeof(name), i == 64 ? "g%d" : "f%d", i);
+        assert((fd0 = fs_open(name)) >= 0 && fs_close(fd0) == 0);
+    }
+    assert(fs_umount() == 0);
+
+    /* test writes without a cache, fresh and whole blocks are not read first and a fresh partial block is zero filled */
+    assert(mount_ram_with_cache(16, "0") == 0 && fs_create("junk") == 0 && (fd0 = fs_open("junk")) >= 0);
+    memset(read_data, 0xee, 16 * 4096);
+    assert(fs_write(fd0, (void *)read_data, 16 * 4096) > 0); /* as many blocks as fit */
+    assert(fs_close(fd0) == 0 && fs_delete("junk") == 0);   /* the freed blocks keep the junk */
+    assert(fs_create("fresh") == 0 && (fd0 = fs_open("fresh")) >= 0);
+    data_reads(&reads_before, &sync_reads_before);
+    assert(fs_write(fd0, (void *)file_data, 4096 + 100) == 4096 + 100);
+    assert(fs_pwrite(fd0, (void *)file_data, 4096, 0) == 4096);
+    data_reads(&reads, &sync_reads);
+    assert(reads == reads_before);
+    assert(fs_pwrite(fd0, (void *)(file_data + 4096 + 50), 40, 4096 + 50) == 40);
+    data_reads(&reads, &sync_reads);
+    assert(reads == reads_before + 1); /* a partial overwrite reads the block back */
+    int tail_blk_cnt = 0;
+    for (size_t blk_idx = 0; blk_idx < (size_t)block_disk_count(); blk_idx++)
+    {
+        assert(block_read(blk_idx, blk) == 0);
+        if (memcmp(blk, file_data + 4096, 100) == 0)
+        {
+            tail_blk_cnt++;
+            for (int i = 100; i < 4096; i++)
+            {
+                assert(blk[i] == 0);
+            }
+        }
+    }
+    assert(tail_blk_cnt == 1);
+    assert(fs_close(fd0) == 0 && fs_umount() == 0);
+
+    /* test positional I/O from several threads sharing an fd, without a cache to serialize on */
+    pthread_t pio_threads[4];
+    struct pio_arg pio_args[4];
+    assert(mount_ram_with_cache(1000, "0") == 0 && fs_create("shared") == 0 && (fd0 = fs_open("shared")) >= 0);
+    assert(fs_write(fd0, (void *)file_data, 64 * 4096) == 64 * 4096);
+    for (int i = 0; i < 4; i++)
+    {
+        pio_args[i] = (struct pio_arg){.fd = fd0, .data = file_data, .seed = i + 1, .write = i == 0};
+        assert(pthread_create(&pio_threads[i], NULL, pio_thread, &pio_args[i]) == 0);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        assert(pthread_join(pio_threads[i], NULL) == 0);
+    }
+    assert(fs_stat(fd0) == 64 * 4096 && fs_close(fd0) == 0 && fs_umount() == 0);
+
+    /* test block_ptr, only the mmap and ram backends map their blocks */
+    assert(block_disk_open_backend(diskname, BLOCK_BACKEND_FILE) == 0);
+    assert(block_ptr(0) == NULL && block_disk_close() == 0);
+    assert(block_disk_open_backend(diskname, BLOCK_BACKEND_MMAP) == 0);
+    assert(block_ptr(0) != NULL && memcmp(block_ptr(0), "ECS150FS", 8) == 0);
+    assert(block_ptr(block_disk_count()) == NULL && block_disk_close() == 0); /* out of bounds */
+    assert(fs_mount_ram(1000) == 0 && block_ptr(0) != NULL && memcmp(block_ptr(0), "ECS150FS", 8) == 0);
+    assert(block_ptr(block_disk_count() - 1) != NULL && block_ptr(block_disk_count()) == NULL);
+    assert(fs_umount() == 0 && block_ptr(0) == NULL); /* no disk open */
+
+    /* test the direct backend, unaligned buffers go through a bounce buffer */
+    static uint8_t unaligned[4096 + 1];
+    if (block_disk_open_backend(diskname, BLOCK_BACKEND_DIRECT) == 0) /* O_DIRECT is not supported everywhere, e.g. tmpfs */
+    {
+        size_t last_blk_idx = block_disk_count() - 1;
+        assert(block_read(0, unaligned + 1) == 0 && memcmp(unaligned + 1, "ECS150FS", 8) == 0);
+        assert(block_read(last_blk_idx, blk) == 0); /* saved to be restored */
+        memcpy(unaligned + 1, file_data, 4096);
+        assert(block_write(last_blk_idx, unaligned + 1) == 0);
+        memset(unaligned, 0, sizeof(unaligned));
+        assert(block_read(last_blk_idx, unaligned + 1) == 0 && memcmp(unaligned + 1, file_data, 4096) == 0);
+        assert(block_write(last_blk_idx, blk) == 0 && block_disk_close() == 0);
+    }
+
+    /* test the disk throttle, requests take at least the configured latency and transfer time */
+    assert(throttled_reads_us("LIBFS_DISK_LATENCY_US", "2000", 10) >= 10 * 2000);
+    assert(throttled_reads_us("LIBFS_DISK_BW_KBPS", "4096", 10) >= 10 * 1000000LL / 1024); /* 4 KiB at 4 MiB/s */
+
+    /* test file system instances */
+    assert(fs_mount_ctx("nonexistent") == NULL);
+    assert(fs_umount_ctx(NULL) == -1 && fs_ls_ctx(NULL) == -1);
+    assert((ctx = fs_mount_ctx(diskname)) != NULL);
+    assert(fs_ls() == -1); /* the default instance is still unmounted */
+    assert(fs_create_ctx(ctx, "ctxfile") == 0);
+    int fd4 = fs_open_ctx(ctx, "ctxfile");
+    assert(fd4 >= 0 && fs_stat(fd4) == -1);
+    assert(fs_write_ctx(ctx, fd4, (void *)MSG, 20) == 20);
+    assert(fs_lseek_ctx(ctx, fd4, 5) == 0);
+    assert(fs_read_ctx(ctx, fd4, (void *)read_buf, 100) == 15);
+    assert(memcmp(read_buf, MSG + 5, 15) == 0);
+    assert(fs_stat_ctx(ctx, fd4) == 20);
+    assert(fs_sync_ctx(ctx) == 0 && fs_cache_stats_ctx(ctx, &stats) == 0);
+    int aio_result = 0;
+    struct fs_aio aio_cb = {.fd = fd4, .buf = read_buf, .count = 20, .offset = 0, .callback = aio_done, .data = &aio_result};
+    assert(fs_aio_read_ctx(ctx, &aio_cb) == 0);
+    assert(fs_aio_poll_ctx(ctx, done, 2, 1) == 0); /* completed through the callback only */
+    while (__atomic_load_n(&aio_result, __ATOMIC_ACQUIRE) == 0)
+    {
+        usleep(1000);
+    }
+    assert(aio_result == 20 && memcmp(read_buf, MSG, 20) == 0);
+    assert(fs_close_ctx(ctx, fd4) == 0);
+    assert(fs_delete_ctx(ctx, "ctxfile") == 0);
+    assert(fs_umount_ctx(ctx) == 0);
 }
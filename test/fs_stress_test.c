@@ -0,0 +1,306 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+/* Multi-threaded stress test for fs_150, run on a copy of the disk in memory */
+
+#define MAX_THREADS 16
+#define CHUNK 65536            /* bytes per fs_read() of the scaling runs */
+#define READS_PER_THREAD 512
+#define WRITER_ROUNDS 20
+#define AIO_DEPTH 32           /* requests kept in flight by the asynchronous phase */
+#define SLOW_DISK_LATENCY_US "2000"
+#define SLOW_READS_PER_THREAD 64
+#define SLOW_THREADS 8
+
+uint8_t *shared_data; /* expected content of "shared" */
+int shared_size;
+int shared_fd; /* one fd on "shared" used by several readers at once */
+int reads_per_thread = READS_PER_THREAD;
+
+void usage()
+{
+    fprintf(stderr, "Usage: fs_stress_test.x <diskname>\n");
+    exit(1);
+}
+
+uint8_t pattern(int seed, int i)
+{
+    return (uint8_t)(i * 31 + seed * 7 + i / 4096);
+}
+
+double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* random reads of "shared", checked against the expected content */
+void *reader(void *arg)
+{
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    bool positional = seed % 2 == 0; /* every other reader goes through fs_pread() on the shared fd */
+    uint8_t *buf = malloc(CHUNK);
+    int fd = positional ? shared_fd : fs_open("shared");
+
+    assert(buf != NULL && fd >= 0);
+
+    for (int i = 0; i < reads_per_thread; i++)
+    {
+        int offset = rand_r(&seed) % (shared_size - CHUNK + 1);
+        offset -= i % 2 ? offset % 4096 : 0; /* half of the reads are block aligned */
+
+        if (positional)
+        {
+            assert(fs_pread(fd, buf, CHUNK, offset) == CHUNK);
+        }
+        else
+        {
+            assert(fs_lseek(fd, offset) == 0);
+            assert(fs_read(fd, buf, CHUNK) == CHUNK);
+        }
+
+        assert(memcmp(buf, shared_data + offset, CHUNK) == 0);
+    }
+
+    assert(positional || fs_close(fd) == 0);
+    free(buf);
+
+    return NULL;
+}
+
+/* create, fill, check and delete a private file over and over */
+void *writer(void *arg)
+{
+    int id = (int)(uintptr_t)arg;
+    int size = 3 * 4096 + 100 * id;
+    uint8_t *buf = malloc(size);
+    uint8_t *read_buf = malloc(size);
+    char filename[FS_FILENAME_LEN];
+
+    assert(buf != NULL && read_buf != NULL);
+    snprintf(filename, sizeof(filename), "writer%d", id);
+
+    for (int i = 0; i < size; i++)
+    {
+        buf[i] = pattern(id, i);
+    }
+
+    for (int round = 0; round < WRITER_ROUNDS; round++)
+    {
+        assert(fs_create(filename) == 0);
+        int fd = fs_open(filename);
+        assert(fd >= 0);
+
+        /* grow the file in uneven steps so that allocations interleave with other writers */
+        for (int written = 0; written < size;)
+        {
+            int step = size - written < 1000 + 300 * id ? size - written : 1000 + 300 * id;
+            assert(fs_write(fd, buf + written, step) == step);
+            written += step;
+        }
+
+        assert(fs_stat(fd) == size);
+        assert(fs_lseek(fd, 0) == 0);
+        assert(fs_read(fd, read_buf, size) == size);
+        assert(memcmp(buf, read_buf, size) == 0);
+        assert(fs_close(fd) == 0);
+        assert(fs_delete(filename) == 0);
+    }
+
+    free(buf);
+    free(read_buf);
+
+    return NULL;
+}
+
+double run_readers(int thread_cnt)
+{
+    pthread_t threads[MAX_THREADS];
+    double start = now();
+
+    for (int i = 0; i < thread_cnt; i++)
+    {
+        assert(pthread_create(&threads[i], NULL, reader, (void *)(uintptr_t)(i + 1)) == 0);
+    }
+
+    for (int i = 0; i < thread_cnt; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    return now() - start;
+}
+
+/* 1. fill "shared" with half of what the disk holds, up to 8 MiB, leaving room for the writers */
+void mount_and_fill(const char *diskname)
+{
+    assert(fs_mount(diskname) == 0);
+    assert(fs_create("shared") == 0);
+    int fd = fs_open("shared");
+    assert(fd >= 0);
+    shared_size = fs_write(fd, shared_data, 8 << 20) / 4096 / 2 * 4096; /* fs_write() stops when the disk is full */
+    assert(shared_size >= 2 * CHUNK);
+    assert(fs_close(fd) == 0 && fs_delete("shared") == 0 && fs_create("shared") == 0);
+    fd = fs_open("shared");
+    assert(fs_write(fd, shared_data, shared_size) == shared_size);
+    shared_fd = fd;
+}
+
+/* 2. readers of the same file, the throughput should grow with the number of cores */
+void scale_readers()
+{
+    long core_cnt = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = core_cnt < 1 ? 1 : core_cnt > MAX_THREADS ? MAX_THREADS : core_cnt;
+    double base = 0;
+
+    printf("%d cores, %d KiB file, %d reads of %d KiB per thread\n",
+           (int)core_cnt, shared_size / 1024, reads_per_thread, CHUNK / 1024);
+    printf("threads      MiB/s    speedup\n");
+
+    for (int thread_cnt = 1;; thread_cnt = thread_cnt * 2 > max_threads ? max_threads : thread_cnt * 2)
+    {
+        double elapsed = run_readers(thread_cnt);
+        double mib_per_sec = (double)thread_cnt * reads_per_thread * CHUNK / elapsed / (1 << 20);
+
+        base = base == 0 ? mib_per_sec : base;
+        printf("%7d %10.1f %9.2fx\n", thread_cnt, mib_per_sec, mib_per_sec / base);
+
+        if (thread_cnt == max_threads)
+        {
+            break;
+        }
+    }
+}
+
+/* 3. writers creating and deleting files while readers go on */
+void mix_readers_and_writers()
+{
+    pthread_t threads[MAX_THREADS];
+
+    for (int i = 0; i < MAX_THREADS; i++)
+    {
+        void *(*routine)(void *) = i % 2 ? writer : reader;
+        assert(pthread_create(&threads[i], NULL, routine, (void *)(uintptr_t)(i + 1)) == 0);
+    }
+
+    for (int i = 0; i < MAX_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* 4. @read_cnt asynchronous reads of "shared", AIO_DEPTH of them in flight at any time, returns MiB/s */
+double read_async(int read_cnt)
+{
+    struct fs_aio reqs[AIO_DEPTH], *done[AIO_DEPTH];
+    uint8_t *aio_bufs = malloc((size_t)AIO_DEPTH * CHUNK);
+    unsigned int seed = 1;
+    int submitted = 0, completed = 0;
+    double start = now();
+
+    assert(aio_bufs != NULL);
+
+    for (int i = 0; i < AIO_DEPTH; i++, submitted++)
+    {
+        reqs[i] = (struct fs_aio){.fd = shared_fd, .buf = aio_bufs + (size_t)i * CHUNK, .count = CHUNK};
+        reqs[i].offset = rand_r(&seed) % (shared_size - CHUNK + 1);
+        assert(fs_aio_read(&reqs[i]) == 0);
+    }
+
+    while (completed < submitted)
+    {
+        int cnt = fs_aio_poll(done, AIO_DEPTH, 1);
+        assert(cnt > 0);
+
+        for (int i = 0; i < cnt; i++, completed++)
+        {
+            struct fs_aio *req = done[i];
+            assert(req->result == CHUNK && memcmp(req->buf, shared_data + req->offset, CHUNK) == 0);
+
+            if (submitted < read_cnt)
+            {
+                req->offset = rand_r(&seed) % (shared_size - CHUNK + 1); /* reuse the request right away */
+                assert(fs_aio_read(req) == 0);
+                submitted++;
+            }
+        }
+    }
+
+    double mib_per_sec = (double)submitted * CHUNK / (now() - start) / (1 << 20);
+
+    printf("async reads, %d in flight: %.1f MiB/s\n", AIO_DEPTH, mib_per_sec);
+    free(aio_bufs);
+
+    return mib_per_sec;
+}
+
+/* every writer file is gone, "shared" is untouched */
+void check_and_umount()
+{
+    assert(fs_open("writer2") == -1);
+    int fd = fs_open("shared");
+    assert(fd >= 0 && fs_stat(fd) == shared_size);
+    assert(fs_close(fd) == 0 && fs_close(shared_fd) == 0);
+    assert(fs_delete("shared") == 0);
+    assert(fs_umount() == 0);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+        usage();
+
+    shared_data = malloc(8 << 20);
+    assert(shared_data != NULL);
+
+    for (int i = 0; i < 8 << 20; i++)
+    {
+        shared_data[i] = pattern(0, i);
+    }
+
+    /* in memory, then on the image file where block I/O really waits, unless told to use one backend */
+    const char *backend = getenv("LIBFS_DISK_BACKEND");
+    const char *backends[] = {"ram", "file"};
+
+    for (int i = 0; i < 2 && (i == 0 || backend == NULL); i++)
+    {
+        setenv("LIBFS_DISK_BACKEND", backend != NULL ? backend : backends[i], 1);
+        printf("%s backend\n", getenv("LIBFS_DISK_BACKEND"));
+        mount_and_fill(argv[1]);
+        scale_readers();
+        mix_readers_and_writers();
+        read_async(reads_per_thread);
+        check_and_umount();
+    }
+
+    /* 5. a slow disk without cache, readers waiting on block I/O must overlap whatever the number of cores */
+    setenv("LIBFS_DISK_BACKEND", backend != NULL ? backend : "file", 1);
+    setenv("LIBFS_DISK_LATENCY_US", SLOW_DISK_LATENCY_US, 1);
+    setenv("LIBFS_CACHE_BLOCKS", "0", 1);
+    mount_and_fill(argv[1]);
+    reads_per_thread = SLOW_READS_PER_THREAD;
+
+    double one = reads_per_thread * CHUNK / run_readers(1) / (1 << 20);
+    double many = SLOW_THREADS * reads_per_thread * CHUNK / run_readers(SLOW_THREADS) / (1 << 20);
+
+    printf("%s us per request: 1 thread %.1f MiB/s, %d threads %.1f MiB/s\n", SLOW_DISK_LATENCY_US, one, SLOW_THREADS, many);
+    assert(many >= 2 * one);
+    assert(read_async(SLOW_THREADS * reads_per_thread) >= 2 * one); /* as many reads as the threads did */
+    check_and_umount();
+
+    free(shared_data);
+    printf("ok\n");
+
+    return 0;
+}
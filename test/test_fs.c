@@ -9,6 +9,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <disk.h>
 #include <fs.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -286,6 +287,8 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_stats(void *arg);
+
 static struct
 {
 	const char *name;
@@ -296,7 +299,8 @@ static struct
 	{"add", thread_fs_add},
 	{"rm", thread_fs_rm},
 	{"cat", thread_fs_cat},
-	{"stat", thread_fs_stat}};
+	{"stat", thread_fs_stat},
+	{"stats", thread_fs_stats}};
 
 void usage(char *program)
 {
@@ -308,6 +312,62 @@ void usage(char *program)
 	exit(1);
 }
 
+void thread_fs_stats(void *arg)
+{
+	static const char *category[BLOCK_CAT_COUNT] = {"super", "fat", "root", "data"};
+	struct thread_arg *t_arg = arg;
+	struct thread_arg cmd_arg;
+	struct block_stats stats;
+	int i, j;
+
+	if (t_arg->argc < 1)
+		die("Usage: <command> [<arg>]");
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++)
+	{
+		if (!strcmp(t_arg->argv[0], commands[i].name) && commands[i].func != thread_fs_stats)
+			break;
+	}
+	if (i == ARRAY_SIZE(commands))
+		die("invalid command '%s'", t_arg->argv[0]);
+
+	/* run the command, then report the disk traffic it caused */
+	cmd_arg.argc = t_arg->argc - 1;
+	cmd_arg.argv = &t_arg->argv[1];
+	commands[i].func(&cmd_arg);
+
+	if (block_stats_snapshot(&stats))
+		die("Cannot get disk statistics");
+
+	printf("I/O stats:\n");
+	printf("%-6s %8s %8s %12s %12s\n", "blocks", "reads", "writes", "bytes_read", "bytes_written");
+	for (i = 0; i < BLOCK_CAT_COUNT; i++)
+	{
+		struct block_io_stats *st = &stats.cat[i];
+
+		printf("%-6s %8llu %8llu %12llu %12llu\n", category[i],
+			   st->reads, st->writes, st->bytes_read, st->bytes_written);
+	}
+
+	printf("Latency (us):\n");
+	for (i = 0; i < BLOCK_CAT_COUNT; i++)
+	{
+		printf("%-6s", category[i]);
+		for (j = 0; j < BLOCK_STATS_LAT_BUCKETS; j++)
+		{
+			if (!stats.cat[i].lat_hist[j])
+				continue;
+			if (j == 0)
+				printf(" <2:%llu", stats.cat[i].lat_hist[j]);
+			else if (j == BLOCK_STATS_LAT_BUCKETS - 1)
+				printf(" >=%d:%llu", 1 << j, stats.cat[i].lat_hist[j]);
+			else
+				printf(" [%d,%d):%llu", 1 << j, 2 << j, stats.cat[i].lat_hist[j]);
+		}
+		printf("\n");
+	}
+}
+
 int main(int argc, char **argv)
 {
 	int i;